@@ -0,0 +1,209 @@
+#ifndef MINIVSFS_BITMAP_ALLOC_H
+#define MINIVSFS_BITMAP_ALLOC_H
+
+/*
+ * Word-at-a-time allocator over an on-disk MiniVSFS bitmap.
+ *
+ * Bit i of the bitmap is bit (i % 8) of byte (i / 8), which on a
+ * little-endian load is bit (i % 64) of 64-bit word (i / 64), so free bits
+ * are found with one __builtin_ctzll(~word) per 64 objects. The allocator
+ * keeps a next-fit cursor: a search starts where the previous allocation
+ * ended and wraps around once. Nothing in MiniVSFS frees objects during a
+ * run, so next-fit hands out exactly the blocks first-fit would.
+ *
+ * For large bitmaps, bitmap_summary_build() adds an in-memory free summary:
+ * bit j of level-0 word i is set while bitmap word 64*i+j has a free bit, and
+ * each further level summarizes the one below it the same way, up to a
+ * single word. bitmap_set()/bitmap_clear() keep it current, touching the
+ * upper levels only when a word fills up or gets its first free bit, and a
+ * search skips any run of full words with one ctz per level.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BITMAP_SUMMARY_LEVELS 6     // enough for 64^6 words, i.e. 2^42 objects
+
+typedef struct {
+    uint8_t *bits;      // on-disk bitmap bytes, modified in place
+    uint64_t nbits;     // number of objects tracked
+    uint64_t cursor;    // next-fit start position
+    int64_t used_delta; // bits set minus bits cleared since bitmap_init
+    int levels;         // free summary levels, 0 if there is no summary
+    uint64_t *summary[BITMAP_SUMMARY_LEVELS];
+    uint64_t summary_words[BITMAP_SUMMARY_LEVELS];
+} bitmap_t;
+
+static inline uint64_t bitmap_load_word(const uint8_t *bits, uint64_t w){
+    uint64_t v; memcpy(&v, bits + w * 8, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline void bitmap_init(bitmap_t *bm, uint8_t *bits, uint64_t nbits){
+    bm->bits = bits;
+    bm->nbits = nbits;
+    bm->cursor = 0;
+    bm->used_delta = 0;
+    bm->levels = 0;
+}
+
+static inline int bitmap_test(const bitmap_t *bm, uint64_t i){
+    return (bm->bits[i / 8] >> (i % 8)) & 1;
+}
+
+// Word w with used bits set, treating bits below 'from' and past nbits as used.
+static inline uint64_t bitmap_used_word(const bitmap_t *bm, uint64_t w, uint64_t from){
+    uint64_t base = w * 64, word;
+    if (base + 64 <= bm->nbits) {
+        word = bitmap_load_word(bm->bits, w);
+    } else {
+        // Partial tail word: never read past the last byte of the bitmap.
+        uint64_t valid = bm->nbits - base;
+        uint8_t tmp[8] = {0};
+        memcpy(tmp, bm->bits + w * 8, (valid + 7) / 8);
+        word = bitmap_load_word(tmp, 0) | (~0ull << valid);
+    }
+    if (from > base) word |= (from - base >= 64) ? ~0ull : ((1ull << (from - base)) - 1);
+    return word;
+}
+
+// Refreshes the summary bits above bitmap word w after a bit in it changed.
+static inline void bitmap_summary_update(bitmap_t *bm, uint64_t w){
+    int has_free = bitmap_used_word(bm, w, 0) != ~0ull;
+    for (int k = 0; k < bm->levels; k++, w /= 64) {
+        uint64_t *word = &bm->summary[k][w / 64];
+        uint64_t before = *word;
+        if (has_free) *word |= 1ull << (w % 64);
+        else *word &= ~(1ull << (w % 64));
+        if ((before != 0) == (*word != 0)) break;   // the level above is unaffected
+        has_free = *word != 0;
+    }
+}
+
+static inline void bitmap_set(bitmap_t *bm, uint64_t i){
+    uint8_t mask = (uint8_t)(1u << (i % 8));
+    bm->used_delta += !(bm->bits[i / 8] & mask);
+    bm->bits[i / 8] |= mask;
+    if (bm->levels) bitmap_summary_update(bm, i / 64);
+}
+
+static inline void bitmap_clear(bitmap_t *bm, uint64_t i){
+    uint8_t mask = (uint8_t)(1u << (i % 8));
+    bm->used_delta -= !!(bm->bits[i / 8] & mask);
+    bm->bits[i / 8] &= (uint8_t)~mask;
+    if (bm->levels) bitmap_summary_update(bm, i / 64);
+}
+
+static inline void bitmap_summary_free(bitmap_t *bm){
+    for (int k = 0; k < bm->levels; k++) free(bm->summary[k]);
+    bm->levels = 0;
+}
+
+// Builds the free summary from the current bitmap. Returns -1 (and leaves none) when out of memory.
+static inline int bitmap_summary_build(bitmap_t *bm){
+    bitmap_summary_free(bm);
+    uint64_t below = (bm->nbits + 63) / 64;     // words in the level being summarized
+    for (int k = 0; k < BITMAP_SUMMARY_LEVELS; k++) {
+        uint64_t words = (below + 63) / 64;
+        uint64_t *level = calloc(words ? words : 1, sizeof(*level));
+        if (!level) {
+            bitmap_summary_free(bm);
+            return -1;
+        }
+        for (uint64_t w = 0; w < below; w++) {
+            int has_free = k == 0 ? bitmap_used_word(bm, w, 0) != ~0ull : bm->summary[k - 1][w] != 0;
+            if (has_free) level[w / 64] |= 1ull << (w % 64);
+        }
+        bm->summary[k] = level;
+        bm->summary_words[k] = words;
+        bm->levels = k + 1;
+        if (words <= 1) return 0;
+        below = words;
+    }
+    bitmap_summary_free(bm);    // more objects than the levels can cover: search without it
+    return -1;
+}
+
+// First set bit at or after position i of summary level k, or -1.
+static inline int64_t bitmap_summary_next(const bitmap_t *bm, int k, uint64_t i){
+    if (i / 64 >= bm->summary_words[k]) return -1;
+    uint64_t word = bm->summary[k][i / 64] & (~0ull << (i % 64));
+    if (word) return (int64_t)(i / 64 * 64 + (uint64_t)__builtin_ctzll(word));
+    int64_t up = k + 1 < bm->levels ? bitmap_summary_next(bm, k + 1, i / 64 + 1) : -1;
+    if (up < 0) return -1;
+    return up * 64 + __builtin_ctzll(bm->summary[k][up]);
+}
+
+// First free bit in [from, to), or -1.
+static inline int64_t bitmap_scan(const bitmap_t *bm, uint64_t from, uint64_t to){
+    if (from >= to) return -1;
+    if (bm->levels) {
+        uint64_t w = from / 64;
+        uint64_t word = bitmap_used_word(bm, w, from);
+        if (word == ~0ull) {
+            int64_t next = bitmap_summary_next(bm, 0, w + 1);
+            if (next < 0) return -1;
+            w = (uint64_t)next;
+            word = bitmap_used_word(bm, w, 0);
+        }
+        uint64_t i = w * 64 + (uint64_t)__builtin_ctzll(~word);
+        return i < to ? (int64_t)i : -1;
+    }
+    for (uint64_t w = from / 64; w * 64 < to; w++) {
+        uint64_t word = bitmap_used_word(bm, w, from);
+        if (word != ~0ull) {
+            uint64_t i = w * 64 + (uint64_t)__builtin_ctzll(~word);
+            return i < to ? (int64_t)i : -1;
+        }
+    }
+    return -1;
+}
+
+// Next free bit at or after the cursor, wrapping once; -1 when full.
+static inline int64_t bitmap_find_free(const bitmap_t *bm){
+    int64_t i = bitmap_scan(bm, bm->cursor, bm->nbits);
+    if (i < 0) i = bitmap_scan(bm, 0, bm->cursor < bm->nbits ? bm->cursor : bm->nbits);
+    return i;
+}
+
+// Number of used bits, one popcount per 64 objects.
+static inline uint64_t bitmap_count_used(const bitmap_t *bm){
+    uint64_t used = 0;
+    for (uint64_t w = 0; w * 64 < bm->nbits; w++) {
+        uint64_t word = bitmap_used_word(bm, w, 0);
+        if (w * 64 + 64 > bm->nbits) word &= (1ull << (bm->nbits - w * 64)) - 1;   // drop the padding bits
+        used += (uint64_t)__builtin_popcountll(word);
+    }
+    return used;
+}
+
+/*
+ * Allocates up to n objects, marking them used and storing their indices in
+ * out[] in allocation order. Returns how many were allocated; a short count
+ * means the bitmap is full and the caller should bitmap_release() them.
+ */
+static inline uint64_t bitmap_alloc(bitmap_t *bm, uint64_t n, uint64_t *out){
+    uint64_t got = 0;
+    while (got < n) {
+        int64_t i = bitmap_find_free(bm);
+        if (i < 0) break;
+        bitmap_set(bm, (uint64_t)i);
+        out[got++] = (uint64_t)i;
+        bm->cursor = (uint64_t)i + 1;
+    }
+    return got;
+}
+
+// Undoes an allocation, e.g. when a later step of the same operation fails.
+static inline void bitmap_release(bitmap_t *bm, const uint64_t *idx, uint64_t n){
+    for (uint64_t k = 0; k < n; k++) {
+        bitmap_clear(bm, idx[k]);
+        if (idx[k] < bm->cursor) bm->cursor = idx[k];
+    }
+}
+
+#endif
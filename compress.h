@@ -0,0 +1,188 @@
+#ifndef MINIVSFS_COMPRESS_H
+#define MINIVSFS_COMPRESS_H
+
+/*
+ * Compressed file storage (INODE_F_COMPRESSED).
+ *
+ * The file is cut into groups of MVZ_GROUP_SIZE bytes, each compressed on
+ * its own with an in-tree LZ4-style codec (the LZ4 block format: greedy
+ * matches of 4+ bytes found through a hash of the next 4 bytes, no entropy
+ * stage). A group that does not shrink is kept as is. The inode's blocks
+ * then hold one byte stream:
+ *
+ *   mvz_header_t
+ *   uint32_t length[ngroups]     stored bytes of each group, | MVZ_STORED if raw
+ *   group payloads, back to back
+ *
+ * size_bytes stays the uncompressed size, so the number of blocks in use
+ * comes from the header (mvz_stored_bytes), not from size_bytes. Groups are
+ * independent, so a reader can decode any one of them after summing the
+ * lengths in front of it.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define MVZ_MAGIC 0x315A564Du      // "MVZ1"
+#define MVZ_GROUP_SIZE (64u * 1024u)
+#define MVZ_STORED 0x80000000u
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t group_size;
+    uint32_t ngroups;
+    uint32_t reserved;
+} mvz_header_t;
+#pragma pack(pop)
+
+static inline uint64_t mvz_group_count(uint64_t size) {
+    return (size + MVZ_GROUP_SIZE - 1) / MVZ_GROUP_SIZE;
+}
+
+// Bytes in front of the first payload.
+static inline uint64_t mvz_table_bytes(uint64_t ngroups) {
+    return sizeof(mvz_header_t) + ngroups * sizeof(uint32_t);
+}
+
+static inline uint64_t mvz_stored_bytes(const uint32_t *lengths, uint64_t ngroups) {
+    uint64_t total = mvz_table_bytes(ngroups);
+    for (uint64_t g = 0; g < ngroups; g++) total += lengths[g] & ~MVZ_STORED;
+    return total;
+}
+
+
+/* ---- LZ4 block format codec ---- */
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5     // the block must end with at least this many literals
+#define LZ_MF_LIMIT 12         // no match may start in the last 12 bytes
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+static inline uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Appends a length's 255-continuation bytes; returns NULL if out of room.
+static inline uint8_t *lz_put_length(uint8_t *op, const uint8_t *oend, uint64_t len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static inline uint8_t *lz_put_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *lit, uint64_t nlit,
+                                       uint32_t offset, uint64_t mlen, int has_match) {
+    if (op >= oend) return NULL;
+    uint8_t *token = op++;
+    *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15 && !(op = lz_put_length(op, oend, nlit - 15))) return NULL;
+    if ((uint64_t)(oend - op) < nlit) return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!has_match) return op;
+    if (oend - op < 2) return NULL;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    mlen -= LZ_MIN_MATCH;
+    *token |= (uint8_t)(mlen < 15 ? mlen : 15);
+    if (mlen >= 15 && !(op = lz_put_length(op, oend, mlen - 15))) return NULL;
+    return op;
+}
+
+/*
+ * Compresses n bytes into dst. Returns the compressed length, or 0 if it
+ * would not fit in cap bytes; pass cap < n to only accept real savings.
+ */
+static inline uint64_t lz_compress(const uint8_t *src, uint64_t n, uint8_t *dst, uint64_t cap) {
+    uint32_t table[1u << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    const uint8_t *ip = src, *anchor = src, *end = src + n;
+    uint8_t *op = dst;
+    const uint8_t *oend = dst + cap;
+
+    if (n > LZ_MF_LIMIT) {
+        const uint8_t *mf_limit = end - LZ_MF_LIMIT;
+        const uint8_t *match_limit = end - LZ_LAST_LITERALS;
+        while (ip < mf_limit) {
+            uint32_t seq = lz_read32(ip);
+            uint32_t h = lz_hash(seq);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *mp = ip + LZ_MIN_MATCH, *rp = ref + LZ_MIN_MATCH;
+            while (mp < match_limit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+            op = lz_put_sequence(op, oend, anchor, ip - anchor, (uint32_t)(ip - ref), mp - ip, 1);
+            if (!op) return 0;
+            ip = anchor = mp;
+            if (ip - 2 > src && ip < mf_limit) table[lz_hash(lz_read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+        }
+    }
+    op = lz_put_sequence(op, oend, anchor, end - anchor, 0, 0, 0);
+    return op ? (uint64_t)(op - dst) : 0;
+}
+
+// Decodes src into dst. Returns the decoded length, or -1 if the input is malformed or too big for cap.
+static inline int64_t lz_decompress(const uint8_t *src, uint64_t n, uint8_t *dst, uint64_t cap) {
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        uint64_t nlit = token >> 4;
+        if (nlit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                nlit += b;
+            } while (b == 255);
+        }
+        if (nlit > (uint64_t)(iend - ip) || nlit > (uint64_t)(oend - op)) return -1;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == iend) break;      // the last sequence has literals only
+
+        if (iend - ip < 2) return -1;
+        uint32_t offset = ip[0] | (uint32_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (uint64_t)(op - dst)) return -1;
+        uint64_t mlen = token & 15;
+        if (mlen == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (mlen > (uint64_t)(oend - op)) return -1;
+        const uint8_t *m = op - offset;
+        for (uint64_t i = 0; i < mlen; i++) op[i] = m[i];    // may overlap its own output
+        op += mlen;
+    }
+    return op - dst;
+}
+
+#endif
@@ -0,0 +1,374 @@
+#ifndef MINIVSFS_CRC32_H
+#define MINIVSFS_CRC32_H
+
+/*
+ * IEEE CRC32 (reflected polynomial 0xEDB88320) shared by the MiniVSFS tools.
+ *
+ * crc32() is the only entry point the tools use. It dispatches to the fastest
+ * implementation the CPU supports:
+ *   - PCLMULQDQ folding (x86 with PCLMULQDQ + SSE4.1), 16-byte chunks
+ *   - slicing-by-16 / slicing-by-8 tables on little-endian hosts
+ *   - the original byte-at-a-time table loop everywhere else
+ * Every candidate is checked against the byte loop before it is selected, so a
+ * broken fast path can only cost speed, never produce a different checksum.
+ *
+ * The tables are generated ahead of time (crc32_gen.c -> crc32_tables.h) into
+ * read-only data, and the implementation is picked lazily on the first call,
+ * so there is no init step and concurrent callers need no locking: racing
+ * first calls all select the same function and store the same pointer.
+ *
+ * crc32c() is CRC32C (Castagnoli, reflected 0x82F63B78), used for the data
+ * block checksum table. It dispatches the same way, to the SSE4.2 crc32
+ * instruction where available and to slicing-by-8 / the byte loop otherwise.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define CRC32_HAVE_X86 1
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CRC32_HAVE_SLICING 1
+#endif
+
+#include "crc32_tables.h"
+
+typedef uint32_t (*crc32_update_fn)(uint32_t c, const uint8_t *p, size_t n);
+
+// Byte-at-a-time reference loop; operates on the pre-inverted state.
+static uint32_t crc32_update_table(uint32_t c, const uint8_t *p, size_t n){
+    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
+    return c;
+}
+
+#ifdef CRC32_HAVE_SLICING
+static inline uint32_t crc32_load32(const uint8_t *p){
+    uint32_t v; memcpy(&v, p, 4); return v;
+}
+
+static uint32_t crc32_update_slice8(uint32_t c, const uint8_t *p, size_t n){
+    const uint32_t (*T)[256] = CRC32_SLICE_TAB;
+    while (n >= 8) {
+        uint32_t a = crc32_load32(p) ^ c, b = crc32_load32(p + 4);
+        c = T[7][a & 0xFF] ^ T[6][(a >> 8) & 0xFF] ^ T[5][(a >> 16) & 0xFF] ^ T[4][a >> 24] ^
+            T[3][b & 0xFF] ^ T[2][(b >> 8) & 0xFF] ^ T[1][(b >> 16) & 0xFF] ^ T[0][b >> 24];
+        p += 8; n -= 8;
+    }
+    return crc32_update_table(c, p, n);
+}
+
+static uint32_t crc32_update_slice16(uint32_t c, const uint8_t *p, size_t n){
+    const uint32_t (*T)[256] = CRC32_SLICE_TAB;
+    while (n >= 16) {
+        uint32_t a = crc32_load32(p) ^ c, b = crc32_load32(p + 4);
+        uint32_t d = crc32_load32(p + 8), e = crc32_load32(p + 12);
+        c = T[15][a & 0xFF] ^ T[14][(a >> 8) & 0xFF] ^ T[13][(a >> 16) & 0xFF] ^ T[12][a >> 24] ^
+            T[11][b & 0xFF] ^ T[10][(b >> 8) & 0xFF] ^ T[9][(b >> 16) & 0xFF]  ^ T[8][b >> 24]  ^
+            T[7][d & 0xFF]  ^ T[6][(d >> 8) & 0xFF]  ^ T[5][(d >> 16) & 0xFF]  ^ T[4][d >> 24]  ^
+            T[3][e & 0xFF]  ^ T[2][(e >> 8) & 0xFF]  ^ T[1][(e >> 16) & 0xFF]  ^ T[0][e >> 24];
+        p += 16; n -= 16;
+    }
+    return crc32_update_slice8(c, p, n);
+}
+#endif
+
+#ifdef CRC32_HAVE_X86
+/*
+ * Carry-less multiply folding after Gopal et al., "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009). Folds four
+ * 128-bit lanes per 64 bytes, reduces to 128 bits, then Barrett-reduces to 32.
+ * Handles n >= 64 in whole 16-byte chunks; the tail goes to the table code.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_update_pclmul(uint32_t c, const uint8_t *p, size_t n){
+    if (n < 64) {
+#ifdef CRC32_HAVE_SLICING
+        return crc32_update_slice8(c, p, n);
+#else
+        return crc32_update_table(c, p, n);
+#endif
+    }
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    size_t tail = n & 15;
+    n -= tail;
+
+    __m128i x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+    p += 64; n -= 64;
+
+    while (n >= 64) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(p + 0x30)));
+        p += 64; n -= 64;
+    }
+
+    // Fold the four lanes into one.
+    __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (n >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)p)), x5);
+        p += 16; n -= 16;
+    }
+
+    // 128 -> 64 bits.
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits.
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    c = (uint32_t)_mm_extract_epi32(x1, 1);
+
+#ifdef CRC32_HAVE_SLICING
+    return crc32_update_slice8(c, p, tail);
+#else
+    return crc32_update_table(c, p, tail);
+#endif
+}
+
+static int crc32_cpu_has_pclmul(void){
+    unsigned a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) return 0;
+    return (c & bit_PCLMUL) && (c & bit_SSE4_1);
+}
+#endif
+
+// Compares a candidate against the byte loop over assorted lengths/alignments.
+static int crc32_selftest(crc32_update_fn fn){
+    uint8_t buf[1024 + 16];
+    uint32_t x = 0x12345678u;
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        buf[i] = (uint8_t)x;
+    }
+    static const size_t lens[] = {0, 1, 7, 8, 15, 16, 63, 64, 65, 120, 127, 128, 255, 1000, 1024};
+    for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+        for (size_t off = 0; off < 16; off += 5) {
+            uint32_t want = crc32_update_table(0xFFFFFFFFu, buf + off, lens[l]);
+            if (fn(0xFFFFFFFFu, buf + off, lens[l]) != want) return 0;
+        }
+    }
+    // "123456789" is the standard check value for CRC-32/ISO-HDLC.
+    return (fn(0xFFFFFFFFu, (const uint8_t *)"123456789", 9) ^ 0xFFFFFFFFu) == 0xCBF43926u;
+}
+
+static crc32_update_fn crc32_select(const char **name){
+#ifdef CRC32_HAVE_X86
+    if (crc32_cpu_has_pclmul() && crc32_selftest(crc32_update_pclmul)) {
+        *name = "pclmul";
+        return crc32_update_pclmul;
+    }
+#endif
+#ifdef CRC32_HAVE_SLICING
+    if (crc32_selftest(crc32_update_slice16)) {
+        *name = "slice16";
+        return crc32_update_slice16;
+    }
+    if (crc32_selftest(crc32_update_slice8)) {
+        *name = "slice8";
+        return crc32_update_slice8;
+    }
+#endif
+    *name = "table";
+    return crc32_update_table;
+}
+
+static uint32_t crc32_update_dispatch(uint32_t c, const uint8_t *p, size_t n);
+
+static crc32_update_fn crc32_update = crc32_update_dispatch;
+static const char *crc32_impl_name = "unselected";
+
+// First call resolves the implementation; later calls go straight to it.
+static uint32_t crc32_update_dispatch(uint32_t c, const uint8_t *p, size_t n){
+    const char *name;
+    crc32_update_fn fn = crc32_select(&name);
+    __atomic_store_n(&crc32_impl_name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&crc32_update, fn, __ATOMIC_RELEASE);
+    return fn(c, p, n);
+}
+
+static inline const char *crc32_impl(void){
+    uint8_t b = 0;
+    crc32_update_fn fn = __atomic_load_n(&crc32_update, __ATOMIC_ACQUIRE);
+    fn(0xFFFFFFFFu, &b, 0);
+    return __atomic_load_n(&crc32_impl_name, __ATOMIC_RELAXED);
+}
+
+static uint32_t crc32(const void* data, size_t n){
+    crc32_update_fn fn = __atomic_load_n(&crc32_update, __ATOMIC_ACQUIRE);
+    return fn(0xFFFFFFFFu, (const uint8_t*)data, n) ^ 0xFFFFFFFFu;
+}
+
+static uint32_t crc32c_update_table(uint32_t c, const uint8_t *p, size_t n){
+    for(size_t i=0;i<n;i++) c = CRC32C_TAB[(c^p[i])&0xFF] ^ (c>>8);
+    return c;
+}
+
+#ifdef CRC32_HAVE_SLICING
+static uint32_t crc32c_update_slice8(uint32_t c, const uint8_t *p, size_t n){
+    const uint32_t (*T)[256] = CRC32C_SLICE_TAB;
+    while (n >= 8) {
+        uint32_t a = crc32_load32(p) ^ c, b = crc32_load32(p + 4);
+        c = T[7][a & 0xFF] ^ T[6][(a >> 8) & 0xFF] ^ T[5][(a >> 16) & 0xFF] ^ T[4][a >> 24] ^
+            T[3][b & 0xFF] ^ T[2][(b >> 8) & 0xFF] ^ T[1][(b >> 16) & 0xFF] ^ T[0][b >> 24];
+        p += 8; n -= 8;
+    }
+    return crc32c_update_table(c, p, n);
+}
+#endif
+
+#ifdef CRC32_HAVE_X86
+static inline uint32_t crc32c_lane_shift(uint32_t c){
+    return CRC32C_LANE_SHIFT[0][c & 0xFF] ^ CRC32C_LANE_SHIFT[1][(c >> 8) & 0xFF] ^
+           CRC32C_LANE_SHIFT[2][(c >> 16) & 0xFF] ^ CRC32C_LANE_SHIFT[3][c >> 24];
+}
+
+/*
+ * The crc32 instruction computes CRC32C, 8 bytes at a time (4 on i386). It
+ * has a latency of several cycles but issues every cycle, so on x86-64 each
+ * 3 * CRC32C_LANE bytes (all of a 4 KiB block but 16 bytes) run as three
+ * independent lanes. The CRC of the concatenation is then
+ * shift(shift(a) ^ b) ^ c, where b and c start from a zero register and
+ * shift advances a register over one lane of zeros (CRC32C_LANE_SHIFT).
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_update_sse42(uint32_t c, const uint8_t *p, size_t n){
+#ifdef __x86_64__
+    uint64_t c64 = c;
+    while (n >= 3 * CRC32C_LANE) {
+        uint64_t b = 0, d = 0;
+        for (size_t i = 0; i < CRC32C_LANE; i += 8) {
+            uint64_t x, y, z;
+            memcpy(&x, p + i, 8);
+            memcpy(&y, p + CRC32C_LANE + i, 8);
+            memcpy(&z, p + 2 * CRC32C_LANE + i, 8);
+            c64 = _mm_crc32_u64(c64, x);
+            b = _mm_crc32_u64(b, y);
+            d = _mm_crc32_u64(d, z);
+        }
+        c64 = crc32c_lane_shift(crc32c_lane_shift((uint32_t)c64) ^ (uint32_t)b) ^ (uint32_t)d;
+        p += 3 * CRC32C_LANE; n -= 3 * CRC32C_LANE;
+    }
+    while (n >= 8) {
+        uint64_t v; memcpy(&v, p, 8);
+        c64 = _mm_crc32_u64(c64, v);
+        p += 8; n -= 8;
+    }
+    c = (uint32_t)c64;
+#else
+    while (n >= 4) {
+        c = _mm_crc32_u32(c, crc32_load32(p));
+        p += 4; n -= 4;
+    }
+#endif
+    while (n--) c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+
+static int crc32_cpu_has_sse42(void){
+    unsigned a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) return 0;
+    return (c & bit_SSE4_2) != 0;
+}
+#endif
+
+static int crc32c_selftest(crc32_update_fn fn){
+    uint8_t buf[8192 + 16];
+    uint32_t x = 0x9E3779B9u;
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        buf[i] = (uint8_t)x;
+    }
+    static const size_t lens[] = {0, 1, 3, 4, 7, 8, 9, 15, 16, 63, 64, 255, 256, 4079, 4080, 4092, 4096, 8192};
+    for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+        for (size_t off = 0; off < 16; off += 5) {
+            uint32_t want = crc32c_update_table(0xFFFFFFFFu, buf + off, lens[l]);
+            if (fn(0xFFFFFFFFu, buf + off, lens[l]) != want) return 0;
+        }
+    }
+    // Standard check value for CRC-32/ISCSI.
+    return (fn(0xFFFFFFFFu, (const uint8_t *)"123456789", 9) ^ 0xFFFFFFFFu) == 0xE3069283u;
+}
+
+static crc32_update_fn crc32c_select(const char **name){
+#ifdef CRC32_HAVE_X86
+    if (crc32_cpu_has_sse42() && crc32c_selftest(crc32c_update_sse42)) {
+        *name = "sse4.2";
+        return crc32c_update_sse42;
+    }
+#endif
+#ifdef CRC32_HAVE_SLICING
+    if (crc32c_selftest(crc32c_update_slice8)) {
+        *name = "slice8";
+        return crc32c_update_slice8;
+    }
+#endif
+    *name = "table";
+    return crc32c_update_table;
+}
+
+static uint32_t crc32c_update_dispatch(uint32_t c, const uint8_t *p, size_t n);
+
+static crc32_update_fn crc32c_update = crc32c_update_dispatch;
+static const char *crc32c_impl_name = "unselected";
+
+static uint32_t crc32c_update_dispatch(uint32_t c, const uint8_t *p, size_t n){
+    const char *name;
+    crc32_update_fn fn = crc32c_select(&name);
+    __atomic_store_n(&crc32c_impl_name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&crc32c_update, fn, __ATOMIC_RELEASE);
+    return fn(c, p, n);
+}
+
+static inline const char *crc32c_impl(void){
+    uint8_t b = 0;
+    crc32_update_fn fn = __atomic_load_n(&crc32c_update, __ATOMIC_ACQUIRE);
+    fn(0xFFFFFFFFu, &b, 0);
+    return __atomic_load_n(&crc32c_impl_name, __ATOMIC_RELAXED);
+}
+
+static uint32_t crc32c(const void* data, size_t n){
+    crc32_update_fn fn = __atomic_load_n(&crc32c_update, __ATOMIC_ACQUIRE);
+    return fn(0xFFFFFFFFu, (const uint8_t*)data, n) ^ 0xFFFFFFFFu;
+}
+
+#endif
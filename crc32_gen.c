@@ -0,0 +1,75 @@
+/*
+ * Generates crc32_tables.h, the read-only slicing tables used by crc32.h.
+ *
+ *   cc -O2 -o crc32_gen crc32_gen.c && ./crc32_gen > crc32_tables.h
+ *
+ * Only needs rerunning if a polynomial or the number of slices changes.
+ */
+#include <stdio.h>
+#include <stdint.h>
+
+#define CRC32_POLY 0xEDB88320u
+#define CRC32_SLICES 16
+#define CRC32C_POLY 0x82F63B78u     // Castagnoli, reflected
+#define CRC32C_SLICES 8
+#define CRC32C_LANE 1360            // bytes per lane of the 3-way SSE4.2 kernel; 3 lanes + 16 = 4096
+
+static void gen_table(uint32_t poly, int slices, uint32_t tab[][256]) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) c = (c & 1) ? (poly ^ (c >> 1)) : (c >> 1);
+        tab[0][i] = c;
+    }
+    for (int k = 1; k < slices; k++)
+        for (int i = 0; i < 256; i++)
+            tab[k][i] = (tab[k-1][i] >> 8) ^ tab[0][tab[k-1][i] & 0xFF];
+}
+
+static void print_table(const char *name, int slices, uint32_t tab[][256]) {
+    printf("static const uint32_t %s[%d][256] = {\n", name, slices);
+    for (int k = 0; k < slices; k++) {
+        printf("    {\n");
+        for (int i = 0; i < 256; i += 8) {
+            printf("        ");
+            for (int j = 0; j < 8; j++) printf("0x%08Xu,%s", tab[k][i+j], j == 7 ? "\n" : " ");
+        }
+        printf("    },\n");
+    }
+    printf("};\n\n");
+}
+
+/*
+ * shift[j][v]: the CRC register v << 8j advanced over len zero bytes. The
+ * advance is linear, so any register is advanced by xoring four lookups.
+ */
+static void gen_shift(const uint32_t tab[256], size_t len, uint32_t shift[4][256]) {
+    for (int j = 0; j < 4; j++)
+        for (uint32_t v = 0; v < 256; v++) {
+            uint32_t c = v << (8 * j);
+            for (size_t i = 0; i < len; i++) c = tab[c & 0xFF] ^ (c >> 8);
+            shift[j][v] = c;
+        }
+}
+
+int main(void) {
+    static uint32_t tab[CRC32_SLICES][256], ctab[CRC32C_SLICES][256], cshift[4][256];
+    gen_table(CRC32_POLY, CRC32_SLICES, tab);
+    gen_table(CRC32C_POLY, CRC32C_SLICES, ctab);
+    gen_shift(ctab[0], CRC32C_LANE, cshift);
+
+    printf("/* Generated by crc32_gen.c -- do not edit. */\n");
+    printf("#ifndef MINIVSFS_CRC32_TABLES_H\n#define MINIVSFS_CRC32_TABLES_H\n\n");
+    printf("#include <stdint.h>\n\n");
+    printf("#define CRC32_SLICES %d\n", CRC32_SLICES);
+    printf("#define CRC32C_SLICES %d\n\n", CRC32C_SLICES);
+    print_table("CRC32_SLICE_TAB", CRC32_SLICES, tab);
+    printf("// Slice 0 is the classic byte-at-a-time table.\n");
+    printf("#define CRC32_TAB CRC32_SLICE_TAB[0]\n\n");
+    print_table("CRC32C_SLICE_TAB", CRC32C_SLICES, ctab);
+    printf("#define CRC32C_TAB CRC32C_SLICE_TAB[0]\n\n");
+    printf("// Advances a CRC32C register over CRC32C_LANE zero bytes, a byte of the register per row.\n");
+    printf("#define CRC32C_LANE %d\n\n", CRC32C_LANE);
+    print_table("CRC32C_LANE_SHIFT", 4, cshift);
+    printf("#endif\n");
+    return 0;
+}
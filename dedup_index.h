@@ -0,0 +1,174 @@
+#ifndef MINIVSFS_DEDUP_INDEX_H
+#define MINIVSFS_DEDUP_INDEX_H
+
+/*
+ * Content index for block-level deduplication (mkfs_adder --dedup).
+ *
+ * Every data block written in dedup mode is recorded as (hash, block,
+ * refs): the CRC32 of its 4 KiB content, its absolute block number, and how
+ * many file block pointers refer to it. The table is open-addressed on the
+ * hash and may hold several blocks with the same hash; a hash match is only
+ * a candidate, and the caller compares contents before sharing a block.
+ *
+ * The index lives next to the image in a sidecar file "<image>.dedup":
+ *
+ *   dedup_header_t, then 'count' dedup_entry_t records (little endian)
+ *
+ * Blocks the index does not know about have a reference count of one. An
+ * image whose blocks may be shared carries MVSFS_FEAT_SHARED, and whatever
+ * frees blocks of such an image must decrement refs here first.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define DEDUP_MAGIC "MVSFSDD1"
+
+#pragma pack(push, 1)
+typedef struct {
+    char magic[8];
+    uint64_t total_blocks;  // of the image the index belongs to
+    uint64_t count;
+} dedup_header_t;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t block;         // 0 marks an empty slot (block 0 is the superblock)
+    uint32_t refs;
+} dedup_entry_t;
+#pragma pack(pop)
+
+typedef struct {
+    dedup_entry_t *slots;
+    uint64_t cap;           // power of two
+    uint64_t count;
+} dedup_index_t;
+
+static inline uint64_t dedup_home(const dedup_index_t *ix, uint32_t hash) {
+    return (hash * 0x9E3779B97F4A7C15ull >> 32) & (ix->cap - 1);
+}
+
+/*
+ * Iterates the entries with this hash: start with *pos = UINT64_MAX and call
+ * until it returns NULL.
+ */
+static inline dedup_entry_t *dedup_next(dedup_index_t *ix, uint32_t hash, uint64_t *pos) {
+    if (ix->cap == 0) return NULL;
+    uint64_t i = *pos == UINT64_MAX ? dedup_home(ix, hash) : (*pos + 1) & (ix->cap - 1);
+    for (; ix->slots[i].block != 0; i = (i + 1) & (ix->cap - 1)) {
+        if (ix->slots[i].hash == hash) {
+            *pos = i;
+            return &ix->slots[i];
+        }
+    }
+    return NULL;
+}
+
+static int dedup_grow(dedup_index_t *ix) {
+    uint64_t cap = ix->cap ? ix->cap * 2 : 1024;
+    dedup_entry_t *slots = calloc(cap, sizeof(*slots));
+    if (!slots) return -1;
+    dedup_index_t grown = { slots, cap, ix->count };
+    for (uint64_t i = 0; i < ix->cap; i++) {
+        if (ix->slots[i].block == 0) continue;
+        uint64_t j = dedup_home(&grown, ix->slots[i].hash);
+        while (slots[j].block != 0) j = (j + 1) & (cap - 1);
+        slots[j] = ix->slots[i];
+    }
+    free(ix->slots);
+    *ix = grown;
+    return 0;
+}
+
+// Records a block; returns its entry, or NULL when out of memory.
+static dedup_entry_t *dedup_insert(dedup_index_t *ix, uint32_t hash, uint32_t block, uint32_t refs) {
+    if ((ix->count + 1) * 4 > ix->cap * 3 && dedup_grow(ix) != 0) return NULL;
+    uint64_t i = dedup_home(ix, hash);
+    while (ix->slots[i].block != 0) i = (i + 1) & (ix->cap - 1);
+    ix->slots[i] = (dedup_entry_t){ .hash = hash, .block = block, .refs = refs };
+    ix->count++;
+    return &ix->slots[i];
+}
+
+static void dedup_free(dedup_index_t *ix) {
+    free(ix->slots);
+    *ix = (dedup_index_t){0};
+}
+
+// Loads the sidecar at path; a missing file gives an empty index.
+static int dedup_load(dedup_index_t *ix, const char *path, uint64_t total_blocks) {
+    *ix = (dedup_index_t){0};
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        if (errno == ENOENT) return 0;
+        perror("Failed to open dedup index");
+        return -1;
+    }
+    dedup_header_t hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, DEDUP_MAGIC, 8) != 0) {
+        fprintf(stderr, "Not a dedup index: %s\n", path);
+        fclose(fp);
+        return -1;
+    }
+    if (hdr.total_blocks != total_blocks) {
+        fprintf(stderr, "Dedup index %s does not belong to this image\n", path);
+        fclose(fp);
+        return -1;
+    }
+    for (uint64_t i = 0; i < hdr.count; i++) {
+        dedup_entry_t e;
+        if (fread(&e, sizeof(e), 1, fp) != 1) {
+            fprintf(stderr, "Dedup index %s is truncated\n", path);
+            fclose(fp);
+            dedup_free(ix);
+            return -1;
+        }
+        if (e.block == 0 || e.block >= total_blocks) continue;
+        if (!dedup_insert(ix, e.hash, e.block, e.refs)) {
+            perror("Failed to load dedup index");
+            fclose(fp);
+            dedup_free(ix);
+            return -1;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Writes the index to path through a temporary file, so a crash leaves the old one intact.
+static int dedup_save(const dedup_index_t *ix, const char *path, uint64_t total_blocks) {
+    size_t len = strlen(path) + 5;
+    char *tmp = malloc(len);
+    if (!tmp) {
+        perror("Failed to save dedup index");
+        return -1;
+    }
+    snprintf(tmp, len, "%s.tmp", path);
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) {
+        perror("Failed to create dedup index");
+        free(tmp);
+        return -1;
+    }
+    dedup_header_t hdr = { .total_blocks = total_blocks, .count = ix->count };
+    memcpy(hdr.magic, DEDUP_MAGIC, 8);
+    int ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    for (uint64_t i = 0; i < ix->cap && ok; i++) {
+        if (ix->slots[i].block != 0) ok = fwrite(&ix->slots[i], sizeof(ix->slots[i]), 1, fp) == 1;
+    }
+    if (fclose(fp) != 0) ok = 0;
+    if (!ok || rename(tmp, path) != 0) {
+        perror("Failed to write dedup index");
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+#endif
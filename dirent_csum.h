@@ -0,0 +1,234 @@
+#ifndef MINIVSFS_DIRENT_CSUM_H
+#define MINIVSFS_DIRENT_CSUM_H
+
+/*
+ * Batch kernels for the XOR checksums of 64-byte directory entries.
+ *
+ * A dirent's last byte is the XOR of its other 63, so an entry is intact
+ * exactly when all 64 of its bytes XOR to zero, and XOR-ing that total into
+ * the last byte recomputes the checksum. Both therefore come down to one
+ * kernel that reduces each entry of a run (usually a whole directory block,
+ * 64 entries at a 64-byte stride) to the XOR of its bytes.
+ *
+ * The vector kernels fold each entry to 16 bytes, then reduce 16 entries
+ * at a time in four levels: each level folds every lane in half and packs
+ * two vectors into one, so that byte p of the result is the total of entry
+ * p. AVX2 does two such groups at once, one per 128-bit lane.
+ * dirent_xor_entries() dispatches like crc32(): AVX2, SSE2, then a 64-bit
+ * scalar loop, picked on the first call after a self-test against the byte
+ * loop, so a broken fast path can only cost speed.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIRENT_CSUM_HAVE_X86 1
+#endif
+
+#define DIRENT_CSUM_ENTRY 64
+
+typedef void (*dirent_xor_fn)(const uint8_t *p, size_t n, uint8_t *out);
+
+// The byte loop dirent_checksum_finalize() uses, over all 64 bytes.
+static void dirent_xor_bytes(const uint8_t *p, size_t n, uint8_t *out){
+    for (size_t e = 0; e < n; e++, p += DIRENT_CSUM_ENTRY) {
+        uint8_t x = 0;
+        for (int i = 0; i < DIRENT_CSUM_ENTRY; i++) x ^= p[i];
+        out[e] = x;
+    }
+}
+
+static void dirent_xor_scalar(const uint8_t *p, size_t n, uint8_t *out){
+    for (size_t e = 0; e < n; e++, p += DIRENT_CSUM_ENTRY) {
+        uint64_t x = 0;
+        for (int i = 0; i < DIRENT_CSUM_ENTRY; i += 8) {
+            uint64_t w;
+            memcpy(&w, p + i, 8);
+            x ^= w;
+        }
+        x ^= x >> 32;
+        x ^= x >> 16;
+        x ^= x >> 8;
+        out[e] = (uint8_t)x;
+    }
+}
+
+#ifdef DIRENT_CSUM_HAVE_X86
+/*
+ * One level of the transpose: folds every lane of a and b in half (x ^= x >> w)
+ * and packs the low halves of a, then b, into one vector.
+ */
+__attribute__((target("sse2")))
+static inline __m128i dirent_fold_pack64_sse2(__m128i a, __m128i b){
+    a = _mm_xor_si128(a, _mm_srli_si128(a, 8));
+    b = _mm_xor_si128(b, _mm_srli_si128(b, 8));
+    return _mm_unpacklo_epi64(a, b);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i dirent_fold_pack32_sse2(__m128i a, __m128i b){
+    a = _mm_xor_si128(a, _mm_srli_epi64(a, 32));
+    b = _mm_xor_si128(b, _mm_srli_epi64(b, 32));
+    return _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2, 0, 2, 0)));
+}
+
+// The 16- and 8-bit levels pack with signed saturation; sign-extending the halves first keeps it exact.
+__attribute__((target("sse2")))
+static inline __m128i dirent_fold_pack16_sse2(__m128i a, __m128i b){
+    a = _mm_xor_si128(a, _mm_srli_epi32(a, 16));
+    b = _mm_xor_si128(b, _mm_srli_epi32(b, 16));
+    return _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16), _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i dirent_fold_pack8_sse2(__m128i a, __m128i b){
+    a = _mm_xor_si128(a, _mm_srli_epi16(a, 8));
+    b = _mm_xor_si128(b, _mm_srli_epi16(b, 8));
+    return _mm_packs_epi16(_mm_srai_epi16(_mm_slli_epi16(a, 8), 8), _mm_srai_epi16(_mm_slli_epi16(b, 8), 8));
+}
+
+__attribute__((target("sse2")))
+static void dirent_xor_sse2(const uint8_t *p, size_t n, uint8_t *out){
+    for (; n >= 16; n -= 16, p += 16 * DIRENT_CSUM_ENTRY, out += 16) {
+        __m128i v[16];
+        for (int j = 0; j < 16; j++) {
+            const __m128i *e = (const __m128i *)(p + j * DIRENT_CSUM_ENTRY);
+            v[j] = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128(e), _mm_loadu_si128(e + 1)),
+                                 _mm_xor_si128(_mm_loadu_si128(e + 2), _mm_loadu_si128(e + 3)));
+        }
+        for (int j = 0; j < 8; j++) v[j] = dirent_fold_pack64_sse2(v[2 * j], v[2 * j + 1]);
+        for (int j = 0; j < 4; j++) v[j] = dirent_fold_pack32_sse2(v[2 * j], v[2 * j + 1]);
+        for (int j = 0; j < 2; j++) v[j] = dirent_fold_pack16_sse2(v[2 * j], v[2 * j + 1]);
+        _mm_storeu_si128((__m128i *)out, dirent_fold_pack8_sse2(v[0], v[1]));
+    }
+    dirent_xor_scalar(p, n, out);
+}
+
+// The same levels on 256 bits; every step stays within its 128-bit lane.
+__attribute__((target("avx2")))
+static void dirent_xor_avx2(const uint8_t *p, size_t n, uint8_t *out){
+    // Lane 0 carries entries [0, 16) of the 32, lane 1 entries [16, 32).
+    for (; n >= 32; n -= 32, p += 32 * DIRENT_CSUM_ENTRY, out += 32) {
+        __m256i v[16];
+        for (int j = 0; j < 16; j++) {
+            const uint8_t *a = p + j * DIRENT_CSUM_ENTRY, *b = a + 16 * DIRENT_CSUM_ENTRY;
+            __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)a),
+                                         _mm256_loadu_si256((const __m256i *)(a + 32)));
+            __m256i y = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)b),
+                                         _mm256_loadu_si256((const __m256i *)(b + 32)));
+            v[j] = _mm256_xor_si256(_mm256_permute2x128_si256(x, y, 0x20), _mm256_permute2x128_si256(x, y, 0x31));
+        }
+        for (int j = 0; j < 8; j++) {
+            __m256i a = v[2 * j], b = v[2 * j + 1];
+            a = _mm256_xor_si256(a, _mm256_srli_si256(a, 8));
+            b = _mm256_xor_si256(b, _mm256_srli_si256(b, 8));
+            v[j] = _mm256_unpacklo_epi64(a, b);
+        }
+        for (int j = 0; j < 4; j++) {
+            __m256i a = v[2 * j], b = v[2 * j + 1];
+            a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 32));
+            b = _mm256_xor_si256(b, _mm256_srli_epi64(b, 32));
+            v[j] = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b),
+                                                         _MM_SHUFFLE(2, 0, 2, 0)));
+        }
+        for (int j = 0; j < 2; j++) {
+            __m256i a = v[2 * j], b = v[2 * j + 1];
+            a = _mm256_xor_si256(a, _mm256_srli_epi32(a, 16));
+            b = _mm256_xor_si256(b, _mm256_srli_epi32(b, 16));
+            v[j] = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16),
+                                      _mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16));
+        }
+        __m256i a = _mm256_xor_si256(v[0], _mm256_srli_epi16(v[0], 8));
+        __m256i b = _mm256_xor_si256(v[1], _mm256_srli_epi16(v[1], 8));
+        _mm256_storeu_si256((__m256i *)out, _mm256_packs_epi16(_mm256_srai_epi16(_mm256_slli_epi16(a, 8), 8),
+                                                               _mm256_srai_epi16(_mm256_slli_epi16(b, 8), 8)));
+    }
+    dirent_xor_sse2(p, n, out);
+}
+#endif
+
+// Compares a candidate against the byte loop on assorted run lengths.
+static int dirent_csum_selftest(dirent_xor_fn fn){
+    uint8_t buf[70 * DIRENT_CSUM_ENTRY], want[70], got[70];
+    uint32_t x = 0x9E3779B9u;
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        buf[i] = (uint8_t)x;
+    }
+    static const size_t lens[] = {0, 1, 15, 16, 17, 31, 32, 33, 64, 70};
+    for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+        dirent_xor_bytes(buf, lens[l], want);
+        memset(got, 0xA5, sizeof(got));
+        fn(buf, lens[l], got);
+        if (memcmp(want, got, lens[l]) != 0) return 0;
+    }
+    return 1;
+}
+
+static dirent_xor_fn dirent_csum_select(const char **name){
+#ifdef DIRENT_CSUM_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && dirent_csum_selftest(dirent_xor_avx2)) {
+        *name = "avx2";
+        return dirent_xor_avx2;
+    }
+    if (__builtin_cpu_supports("sse2") && dirent_csum_selftest(dirent_xor_sse2)) {
+        *name = "sse2";
+        return dirent_xor_sse2;
+    }
+#endif
+    *name = "scalar";
+    return dirent_xor_scalar;
+}
+
+static void dirent_xor_dispatch(const uint8_t *p, size_t n, uint8_t *out);
+
+static dirent_xor_fn dirent_xor_impl = dirent_xor_dispatch;
+static const char *dirent_csum_impl_name = "unselected";
+
+// First call resolves the implementation; later calls go straight to it.
+static void dirent_xor_dispatch(const uint8_t *p, size_t n, uint8_t *out){
+    const char *name;
+    dirent_xor_fn fn = dirent_csum_select(&name);
+    __atomic_store_n(&dirent_csum_impl_name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&dirent_xor_impl, fn, __ATOMIC_RELEASE);
+    fn(p, n, out);
+}
+
+static inline const char *dirent_csum_impl(void){
+    uint8_t b;
+    dirent_xor_fn fn = __atomic_load_n(&dirent_xor_impl, __ATOMIC_ACQUIRE);
+    fn(NULL, 0, &b);
+    return __atomic_load_n(&dirent_csum_impl_name, __ATOMIC_RELAXED);
+}
+
+// out[e] = XOR of all 64 bytes of entry e, for n consecutive entries.
+static inline void dirent_xor_entries(const void *entries, size_t n, uint8_t *out){
+    dirent_xor_fn fn = __atomic_load_n(&dirent_xor_impl, __ATOMIC_ACQUIRE);
+    fn((const uint8_t *)entries, n, out);
+}
+
+// Bit e is set for each of the first n (<= 64) entries whose checksum does not match.
+static inline uint64_t dirent_block_bad(const void *entries, size_t n){
+    uint8_t x[64];
+    uint64_t bad = 0;
+    dirent_xor_entries(entries, n, x);
+    for (size_t e = 0; e < n; e++) bad |= (uint64_t)(x[e] != 0) << e;
+    return bad;
+}
+
+// Recomputes the checksums of n consecutive entries.
+static inline void dirent_block_finalize(void *entries, size_t n){
+    uint8_t x[64];
+    uint8_t *p = entries;
+    for (size_t done = 0; done < n; done += 64) {
+        size_t k = n - done < 64 ? n - done : 64;
+        dirent_xor_entries(p + done * DIRENT_CSUM_ENTRY, k, x);
+        for (size_t e = 0; e < k; e++) p[(done + e) * DIRENT_CSUM_ENTRY + DIRENT_CSUM_ENTRY - 1] ^= x[e];
+    }
+}
+
+#endif
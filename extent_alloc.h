@@ -0,0 +1,347 @@
+#ifndef MINIVSFS_EXTENT_ALLOC_H
+#define MINIVSFS_EXTENT_ALLOC_H
+
+/*
+ * Contiguous data-block allocator over a MiniVSFS data bitmap.
+ *
+ * The free runs of the bitmap are collected into an in-memory free-extent
+ * tree: a treap ordered by (length, start) and augmented with the
+ * lowest-starting extent of every subtree. That one tree answers both
+ * policies in O(log n):
+ *   - best-fit:         the shortest extent with length >= N
+ *   - first-fit-extent: the lowest-addressed extent with length >= N
+ * A request is carved from the front of a single extent whenever one is long
+ * enough. Only if no extent fits does it fall back to fragments, taking the
+ * longest extents first so the file ends up in as few pieces as possible.
+ * The bitmap itself stays authoritative: every allocation also sets its bits.
+ *
+ * The tree is filled lazily, one bitmap block (EXTENT_INDEX_CHUNK bits) at a
+ * time and only as far as needed, so allocating near the front of a large
+ * image never reads the rest of its bitmap. First-fit results are unchanged
+ * by this since everything indexed lies in front of everything that is not.
+ * Best-fit and the fragment fallback need the whole picture and index the
+ * remainder on first use.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "bitmap_alloc.h"
+
+#define EXTENT_INDEX_CHUNK (4096u * 8u)
+
+typedef enum {
+    EXTENT_FIRST_FIT,
+    EXTENT_BEST_FIT,
+} extent_policy_t;
+
+typedef struct {
+    uint64_t start;
+    uint64_t len;
+    uint32_t prio;
+    int32_t left, right;
+    int32_t min_node;   // node with the smallest start in this subtree
+} extent_node_t;
+
+typedef struct {
+    bitmap_t *bm;
+    extent_policy_t policy;
+    extent_node_t *nodes;
+    int32_t count, cap;
+    int32_t root;
+    int32_t free_list;  // recycled nodes, chained through 'left'
+    uint32_t seed;
+    uint64_t free_blocks;   // free blocks indexed so far
+    uint64_t indexed;       // bits [0, indexed) have been scanned
+    int64_t open_start;     // start of a free run reaching 'indexed', or -1
+} extent_index_t;
+
+static inline int extent_key_less(const extent_node_t *a, uint64_t len, uint64_t start){
+    return a->len < len || (a->len == len && a->start < start);
+}
+
+static inline void extent_update(extent_index_t *ix, int32_t t){
+    extent_node_t *n = &ix->nodes[t];
+    n->min_node = t;
+    if (n->left >= 0 && ix->nodes[ix->nodes[n->left].min_node].start < ix->nodes[n->min_node].start)
+        n->min_node = ix->nodes[n->left].min_node;
+    if (n->right >= 0 && ix->nodes[ix->nodes[n->right].min_node].start < ix->nodes[n->min_node].start)
+        n->min_node = ix->nodes[n->right].min_node;
+}
+
+// Splits t into keys < (len, start) and keys >= (len, start).
+static void extent_split(extent_index_t *ix, int32_t t, uint64_t len, uint64_t start,
+                         int32_t *lo, int32_t *hi){
+    if (t < 0) { *lo = *hi = -1; return; }
+    if (extent_key_less(&ix->nodes[t], len, start)) {
+        extent_split(ix, ix->nodes[t].right, len, start, &ix->nodes[t].right, hi);
+        *lo = t;
+    } else {
+        extent_split(ix, ix->nodes[t].left, len, start, lo, &ix->nodes[t].left);
+        *hi = t;
+    }
+    extent_update(ix, t);
+}
+
+static int32_t extent_merge(extent_index_t *ix, int32_t a, int32_t b){
+    if (a < 0) return b;
+    if (b < 0) return a;
+    if (ix->nodes[a].prio > ix->nodes[b].prio) {
+        ix->nodes[a].right = extent_merge(ix, ix->nodes[a].right, b);
+        extent_update(ix, a);
+        return a;
+    }
+    ix->nodes[b].left = extent_merge(ix, a, ix->nodes[b].left);
+    extent_update(ix, b);
+    return b;
+}
+
+static int extent_insert(extent_index_t *ix, uint64_t start, uint64_t len){
+    int32_t t;
+    if (ix->free_list >= 0) {
+        t = ix->free_list;
+        ix->free_list = ix->nodes[t].left;
+    } else {
+        if (ix->count == ix->cap) {
+            int32_t cap = ix->cap ? ix->cap * 2 : 64;
+            extent_node_t *nodes = realloc(ix->nodes, (size_t)cap * sizeof(*nodes));
+            if (!nodes) return -1;
+            ix->nodes = nodes;
+            ix->cap = cap;
+        }
+        t = ix->count++;
+    }
+    ix->seed ^= ix->seed << 13; ix->seed ^= ix->seed >> 17; ix->seed ^= ix->seed << 5;
+    ix->nodes[t] = (extent_node_t){ .start = start, .len = len, .prio = ix->seed,
+                                    .left = -1, .right = -1, .min_node = t };
+    int32_t lo, hi;
+    extent_split(ix, ix->root, len, start, &lo, &hi);
+    ix->root = extent_merge(ix, extent_merge(ix, lo, t), hi);
+    return 0;
+}
+
+// Removes the extent with this key, if the tree has one. Returns 1 if it did.
+static int extent_remove_key(extent_index_t *ix, uint64_t start, uint64_t len){
+    int32_t lo, mid, hi;
+    extent_split(ix, ix->root, len, start, &lo, &mid);
+    extent_split(ix, mid, len, start + 1, &mid, &hi);
+    ix->root = extent_merge(ix, lo, hi);
+    if (mid < 0) return 0;
+    ix->nodes[mid].left = ix->free_list;
+    ix->free_list = mid;
+    return 1;
+}
+
+static void extent_remove(extent_index_t *ix, int32_t t){
+    extent_remove_key(ix, ix->nodes[t].start, ix->nodes[t].len);
+}
+
+// First used bit in [from, to), or 'to'.
+static inline uint64_t extent_scan_used(const bitmap_t *bm, uint64_t from, uint64_t to){
+    for (uint64_t w = from / 64; w * 64 < to; w++) {
+        uint64_t word = bitmap_used_word(bm, w, 0);
+        if (from > w * 64) word &= ~((1ull << (from - w * 64)) - 1);
+        if (word) {
+            uint64_t i = w * 64 + (uint64_t)__builtin_ctzll(word);
+            return i < to ? i : to;
+        }
+    }
+    return to;
+}
+
+// Start of the free run that ends at bit 'to': one past the last used bit below it, or 0.
+static inline uint64_t extent_scan_used_back(const bitmap_t *bm, uint64_t to){
+    if (to == 0) return 0;
+    for (uint64_t w = (to - 1) / 64; ; w--) {
+        uint64_t word = bitmap_used_word(bm, w, 0);
+        if (to - w * 64 < 64) word &= (1ull << (to - w * 64)) - 1;
+        if (word) return w * 64 + 64 - (uint64_t)__builtin_clzll(word);
+        if (w == 0) return 0;
+    }
+}
+
+static int extent_index_run(extent_index_t *ix, uint64_t start, uint64_t end){
+    if (extent_insert(ix, start, end - start) != 0) return -1;
+    ix->free_blocks += end - start;
+    return 0;
+}
+
+// Indexes the next chunk of the bitmap. Returns 1 if it did, 0 when done, -1 on error.
+static int extent_index_more(extent_index_t *ix){
+    const bitmap_t *bm = ix->bm;
+    if (ix->indexed >= bm->nbits) return 0;
+    uint64_t end = ix->indexed + EXTENT_INDEX_CHUNK;
+    if (end > bm->nbits) end = bm->nbits;
+    uint64_t i = ix->indexed;
+    for (;;) {
+        uint64_t s, e;
+        if (ix->open_start >= 0) {
+            s = (uint64_t)ix->open_start;
+        } else {
+            int64_t f = bitmap_scan(bm, i, end);
+            if (f < 0) break;
+            s = (uint64_t)f;
+        }
+        e = extent_scan_used(bm, s > i ? s : i, end);
+        if (e == end && end < bm->nbits) {
+            ix->open_start = (int64_t)s;    // run continues into the next chunk
+            break;
+        }
+        ix->open_start = -1;
+        if (extent_index_run(ix, s, e) != 0) return -1;
+        i = e;
+    }
+    ix->indexed = end;
+    return 1;
+}
+
+static int extent_index_all(extent_index_t *ix){
+    int rc;
+    while ((rc = extent_index_more(ix)) > 0) {}
+    return rc;
+}
+
+static int extent_index_build(extent_index_t *ix, bitmap_t *bm, extent_policy_t policy){
+    *ix = (extent_index_t){ .bm = bm, .policy = policy, .root = -1, .free_list = -1,
+                            .seed = 0x2545F491u, .open_start = -1 };
+    return 0;
+}
+
+// Starts indexing at bit 'start' instead of 0; every bit below it must be in use.
+static void extent_index_skip(extent_index_t *ix, uint64_t start){
+    if (start > ix->bm->nbits) start = ix->bm->nbits;
+    ix->indexed = start;
+}
+
+static void extent_index_free(extent_index_t *ix){
+    free(ix->nodes);
+    ix->nodes = NULL;
+    ix->root = -1;
+}
+
+// Node chosen by the policy for a run of n blocks, or -1 if no extent is long enough.
+static int32_t extent_find(const extent_index_t *ix, uint64_t n){
+    int32_t best = -1;
+    for (int32_t t = ix->root; t >= 0; ) {
+        const extent_node_t *node = &ix->nodes[t];
+        if (node->len < n) {
+            t = node->right;
+            continue;
+        }
+        if (ix->policy == EXTENT_BEST_FIT) {
+            best = t;       // every key >= n along the left spine only gets smaller
+        } else {
+            int32_t cand = t;
+            if (node->right >= 0 && ix->nodes[ix->nodes[node->right].min_node].start < ix->nodes[cand].start)
+                cand = ix->nodes[node->right].min_node;
+            if (best < 0 || ix->nodes[cand].start < ix->nodes[best].start) best = cand;
+        }
+        t = node->left;
+    }
+    return best;
+}
+
+static int32_t extent_longest(const extent_index_t *ix){
+    int32_t t = ix->root;
+    while (t >= 0 && ix->nodes[t].right >= 0) t = ix->nodes[t].right;
+    return t;
+}
+
+// Takes n blocks from the front of extent t and marks them used.
+static int extent_take(extent_index_t *ix, int32_t t, uint64_t n, uint64_t *out){
+    uint64_t start = ix->nodes[t].start, len = ix->nodes[t].len;
+    extent_remove(ix, t);
+    if (len > n && extent_insert(ix, start + n, len - n) != 0) return -1;
+    for (uint64_t k = 0; k < n; k++) {
+        bitmap_set(ix->bm, start + k);
+        out[k] = start + k;
+    }
+    ix->free_blocks -= n;
+    return 0;
+}
+
+/*
+ * Allocates n data blocks, storing their bitmap indices in out[] in file
+ * order, and the number of contiguous runs used in *fragments. Returns how
+ * many blocks were allocated; a short count means the region is out of space
+ * (or out of memory) and the caller should extent_release() what it got.
+ */
+static uint64_t extent_alloc(extent_index_t *ix, uint64_t n, uint64_t *out, uint64_t *fragments){
+    *fragments = 0;
+    if (n == 0) return 0;
+    if (ix->policy == EXTENT_BEST_FIT && extent_index_all(ix) < 0) return 0;
+    int32_t t;
+    for (;;) {
+        t = extent_find(ix, n);
+        if (t >= 0) break;
+        int rc = extent_index_more(ix);
+        if (rc < 0) return 0;
+        if (rc == 0) break;
+    }
+    if (t >= 0) {
+        if (extent_take(ix, t, n, out) != 0) return 0;
+        *fragments = 1;
+        return n;
+    }
+    uint64_t got = 0;
+    while (got < n && (t = extent_longest(ix)) >= 0) {
+        uint64_t take = ix->nodes[t].len < n - got ? ix->nodes[t].len : n - got;
+        if (extent_take(ix, t, take, out + got) != 0) break;
+        got += take;
+        (*fragments)++;
+    }
+    return got;
+}
+
+/*
+ * Indexes the freed run [start, end), whose bits are already clear, merged
+ * with the free extents on either side. The bitmap gives the neighbours'
+ * keys: the free runs touching the freed one are exactly the extents to merge.
+ * A neighbour that is not in the tree (left out by an earlier allocation
+ * failure) is simply not merged. A run reaching 'indexed' becomes the open
+ * run instead, so indexing continues it rather than starting a new extent.
+ */
+static void extent_release_run(extent_index_t *ix, uint64_t start, uint64_t end){
+    uint64_t lo = start, hi = end;
+    if (start > 0 && !bitmap_test(ix->bm, start - 1)) {
+        uint64_t s = extent_scan_used_back(ix->bm, start - 1);
+        if (extent_remove_key(ix, s, start - s)) {
+            ix->free_blocks -= start - s;
+            lo = s;
+        }
+    }
+    if (end < ix->indexed && !bitmap_test(ix->bm, end)) {
+        uint64_t e = extent_scan_used(ix->bm, end, ix->indexed);
+        if (ix->open_start == (int64_t)end) {
+            hi = e;     // the open run, which is not in the tree yet
+        } else if (extent_remove_key(ix, end, e - end)) {
+            ix->free_blocks -= e - end;
+            hi = e;
+        }
+    }
+    if (hi == ix->indexed && hi < ix->bm->nbits) {
+        ix->open_start = (int64_t)lo;
+        return;
+    }
+    // On allocation failure the run is simply not indexed; the bitmap stays correct.
+    if (extent_insert(ix, lo, hi - lo) == 0) ix->free_blocks += hi - lo;
+}
+
+/*
+ * Returns blocks to the index and clears their bits, one extent per
+ * contiguous run, merged with the free extents it touches. Only the part of a
+ * run below 'indexed' is indexed now; the rest is picked up from the bitmap
+ * when indexing reaches it.
+ */
+static void extent_release(extent_index_t *ix, const uint64_t *idx, uint64_t n){
+    for (uint64_t k = 0; k < n; ) {
+        uint64_t run = 1;
+        while (k + run < n && idx[k + run] == idx[k] + run) run++;
+        for (uint64_t j = 0; j < run; j++) bitmap_clear(ix->bm, idx[k] + j);
+        if (idx[k] < ix->indexed)
+            extent_release_run(ix, idx[k], idx[k] + run <= ix->indexed ? idx[k] + run : ix->indexed);
+        k += run;
+    }
+}
+
+#endif
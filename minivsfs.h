@@ -0,0 +1,439 @@
+#ifndef MINIVSFS_H
+#define MINIVSFS_H
+
+/*
+ * MiniVSFS on-disk format, shared by mkfs_builder, mkfs_adder, mkfs_extract and mkfs_check.
+ * All structures are little endian; see README.md for the base layout.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "dirent_csum.h"
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define ROOT_INO 1u
+
+#define MVSFS_MAGIC 0x4D565346u
+
+/*
+ * Feature bits in superblock_t.flags. An image only carries a bit once it
+ * uses the feature, so images that never need one stay plain v1 images.
+ */
+#define MVSFS_FEAT_INDIRECT 0x1u    // inodes may use reserved_1/reserved_2 as indirect pointers
+#define MVSFS_FEAT_HASHDIR  0x2u    // directories may use the hashed layout (INODE_F_HASHDIR)
+#define MVSFS_FEAT_SHARED   0x4u    // data blocks may be shared by several files (see dedup_index.h)
+#define MVSFS_FEAT_COMPRESS 0x8u    // files may be stored compressed (INODE_F_COMPRESSED)
+#define MVSFS_FEAT_COUNTERS 0x10u   // block 0 carries exact free-space counters (superblock_ext_t)
+#define MVSFS_FEAT_GROUPS   0x20u   // the layout is split into allocation groups (superblock_ext_t)
+#define MVSFS_FEAT_DATACSUM 0x40u   // every data block in use has a CRC32C in the checksum table (superblock_ext_t)
+#define MVSFS_FEAT_CRC32C   0x80u   // superblock and inode checksums are CRC32C instead of IEEE CRC32
+
+#define MVSFS_FEAT_KNOWN (MVSFS_FEAT_INDIRECT | MVSFS_FEAT_HASHDIR | MVSFS_FEAT_SHARED | MVSFS_FEAT_COMPRESS | \
+                          MVSFS_FEAT_COUNTERS | MVSFS_FEAT_GROUPS | MVSFS_FEAT_DATACSUM | MVSFS_FEAT_CRC32C)
+
+// Per-inode flags in inode_t.reserved_0.
+#define INODE_F_HASHDIR 0x1u        // directory blocks are hash buckets, see dir_lookup()
+#define INODE_F_COMPRESSED 0x2u     // file blocks hold a compressed stream, see compress.h
+
+#define MODE_FILE 0x8000u
+#define MODE_DIR  0x4000u
+#define DIRENT_FILE 1u
+#define DIRENT_DIR  2u
+
+#define N_DIRECT 12u
+#define PTRS_PER_BLOCK (BS / 4u)
+
+// Largest file in blocks: direct, then one single-indirect, then one double-indirect block.
+#define MAX_FILE_BLOCKS ((uint64_t)N_DIRECT + PTRS_PER_BLOCK + (uint64_t)PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;
+} superblock_t;
+#pragma pack(pop)
+
+_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
+
+/*
+ * Superblock extension, stored in block 0 at SB_EXT_OFFSET and therefore
+ * covered by the superblock CRC.
+ *
+ * Free-space counters: with MVSFS_FEAT_COUNTERS set, every tool that
+ * allocates or frees inodes or data blocks keeps them exact, so usage and
+ * "is there room?" are answered without reading a bitmap. The hints are
+ * lower bounds on the first free index: everything below them is in use.
+ *
+ * Allocation groups: with MVSFS_FEAT_GROUPS set, the superblock_t fields
+ * describe group 0 (its bitmap slices, inode table slice and data blocks)
+ * and group g repeats that layout g * group_stride blocks further on. The
+ * inode and data block counts in superblock_t stay image-wide totals; only
+ * the last group may hold fewer of either than the per-group numbers.
+ *
+ * Data checksums: with MVSFS_FEAT_DATACSUM set, csum_blocks blocks from
+ * csum_start, after the last group, hold one uint32_t CRC32C (crc32c() over
+ * all BS bytes) per data index, so entry d covers block data_region_start + d
+ * and the table is read in the same order as the data region. Every tool
+ * that writes a data block in use updates its entry; entries of free blocks
+ * and of group metadata are unspecified.
+ */
+#define SB_EXT_OFFSET 128u
+#define CSUM_PER_BLOCK (BS / 4u)
+
+#pragma pack(push, 1)
+typedef struct {
+    uint64_t free_inodes;
+    uint64_t free_blocks;       // in the data region
+    uint64_t inode_hint;        // inode index (inode number - 1)
+    uint64_t block_hint;        // data index (block - data_region_start)
+    uint64_t group_count;
+    uint64_t group_stride;      // blocks from one group's structures to the next group's
+    uint64_t inodes_per_group;
+    uint64_t blocks_per_group;  // data blocks
+    uint64_t csum_start;
+    uint64_t csum_blocks;
+} superblock_ext_t;
+#pragma pack(pop)
+
+// The extension inside a superblock block buffer (at least BS bytes).
+static inline superblock_ext_t *superblock_ext(void *block0) {
+    return (superblock_ext_t *)((uint8_t *)block0 + SB_EXT_OFFSET);
+}
+
+typedef struct {
+    uint64_t count;
+    uint64_t stride;
+    uint64_t inodes_per_group;
+    uint64_t blocks_per_group;
+} mvsfs_groups_t;
+
+// Group geometry; an image without MVSFS_FEAT_GROUPS is one group spanning everything.
+static inline mvsfs_groups_t mvsfs_groups(const superblock_t *sb, const void *block0) {
+    if (!(sb->flags & MVSFS_FEAT_GROUPS))
+        return (mvsfs_groups_t){ 1, sb->total_blocks, sb->inode_count, sb->data_region_blocks };
+    const superblock_ext_t *ext = superblock_ext((void *)block0);
+    return (mvsfs_groups_t){ ext->group_count, ext->group_stride, ext->inodes_per_group, ext->blocks_per_group };
+}
+
+static inline uint64_t group_inodes(const superblock_t *sb, const mvsfs_groups_t *gr, uint64_t g) {
+    return g + 1 < gr->count ? gr->inodes_per_group : sb->inode_count - (gr->count - 1) * gr->inodes_per_group;
+}
+
+static inline uint64_t group_data_blocks(const superblock_t *sb, const mvsfs_groups_t *gr, uint64_t g) {
+    return g + 1 < gr->count ? gr->blocks_per_group
+                             : sb->data_region_blocks - (gr->count - 1) * gr->blocks_per_group;
+}
+
+/*
+ * Data indices (block - data_region_start) run from 0 to this span. With
+ * groups the span includes the metadata of groups 1 and up, whose indices
+ * are never data blocks.
+ */
+static inline uint64_t data_index_span(const superblock_t *sb, const mvsfs_groups_t *gr) {
+    return (gr->count - 1) * gr->stride + group_data_blocks(sb, gr, gr->count - 1);
+}
+
+/*
+ * Checks that every structure of every group lies inside an image of
+ * file_size bytes. Returns NULL, or what is wrong.
+ */
+static inline const char *superblock_layout_error(const superblock_t *sb, const void *block0, uint64_t file_size) {
+    const uint64_t bits = (uint64_t)BS * 8;
+    uint64_t total = sb->total_blocks;
+    if (sb->block_size != BS || total == 0 || total > file_size / BS || total > UINT32_MAX)
+        return "image size";
+    mvsfs_groups_t gr = mvsfs_groups(sb, block0);
+    if (gr.count == 0 || gr.count > total || gr.stride == 0 || gr.stride > total ||
+        gr.inodes_per_group == 0 || gr.inodes_per_group > UINT32_MAX ||
+        gr.blocks_per_group == 0 || gr.blocks_per_group > total)
+        return "group geometry";
+    if (sb->inode_count < ROOT_INO || sb->inode_count <= (gr.count - 1) * gr.inodes_per_group ||
+        sb->inode_count > gr.count * gr.inodes_per_group ||
+        sb->data_region_blocks <= (gr.count - 1) * gr.blocks_per_group ||
+        sb->data_region_blocks > gr.count * gr.blocks_per_group)
+        return "inode or data block count";
+    if (gr.inodes_per_group > sb->inode_bitmap_blocks * bits ||
+        gr.inodes_per_group > sb->inode_table_blocks * (BS / INODE_SIZE) ||
+        gr.blocks_per_group > sb->data_bitmap_blocks * bits)
+        return "bitmap or inode table size";
+    uint64_t last = (gr.count - 1) * gr.stride;
+    const uint64_t starts[] = { sb->inode_bitmap_start, sb->data_bitmap_start, sb->inode_table_start,
+                                sb->data_region_start };
+    const uint64_t sizes[] = { sb->inode_bitmap_blocks, sb->data_bitmap_blocks, sb->inode_table_blocks,
+                               group_data_blocks(sb, &gr, gr.count - 1) };
+    for (int i = 0; i < 4; i++) {
+        if (starts[i] == 0 || starts[i] >= total || sizes[i] > total - starts[i] ||
+            last > total - starts[i] - sizes[i])
+            return "structure outside the image";
+        // Group 0's structures must fit in front of group 1's.
+        if (gr.count > 1 && starts[i] + (i == 3 ? gr.blocks_per_group : sizes[i]) > sb->inode_bitmap_start + gr.stride)
+            return "groups overlap";
+    }
+    if (sb->flags & MVSFS_FEAT_DATACSUM) {
+        const superblock_ext_t *ext = superblock_ext((void *)block0);
+        uint64_t span = data_index_span(sb, &gr);
+        if (ext->csum_blocks == 0 || ext->csum_blocks > total || ext->csum_blocks * CSUM_PER_BLOCK < span ||
+            ext->csum_start < sb->data_region_start + span || ext->csum_start > total - ext->csum_blocks)
+            return "data checksum table";
+    }
+    return NULL;
+}
+
+// Plausibility check for the counters of an image whose layout is valid.
+static inline int superblock_ext_valid(const superblock_t *sb, const superblock_ext_t *ext) {
+    mvsfs_groups_t gr = mvsfs_groups(sb, (const uint8_t *)ext - SB_EXT_OFFSET);
+    return ext->free_inodes <= sb->inode_count && ext->free_blocks <= sb->data_region_blocks &&
+           ext->inode_hint <= sb->inode_count && ext->block_hint <= data_index_span(sb, &gr);
+}
+
+#pragma pack(push,1)
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t direct[12];
+    uint32_t reserved_0;    // INODE_F_* flags
+    uint32_t reserved_1;    // single-indirect block (MVSFS_FEAT_INDIRECT), else 0
+    uint32_t reserved_2;    // double-indirect block (MVSFS_FEAT_INDIRECT), else 0
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;
+    uint64_t inode_crc;
+} inode_t;
+#pragma pack(pop)
+
+_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t inode_no;
+    uint8_t type;
+    char name[58];
+    uint8_t checksum;
+} dirent64_t;
+#pragma pack(pop)
+
+_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+
+
+/*
+ * Superblock and inode checksum for an image with the given superblock
+ * flags: IEEE crc32() as in v1 images, or crc32c() with MVSFS_FEAT_CRC32C,
+ * which has a CPU instruction on x86. The flag is chosen when the image is
+ * built and never changes, since every inode would have to be rewritten.
+ */
+static inline uint32_t mvsfs_crc(uint32_t flags, const void *data, size_t n) {
+    return flags & MVSFS_FEAT_CRC32C ? crc32c(data, n) : crc32(data, n);
+}
+
+// sb must point at the start of a zero-padded BS-byte block buffer; sb->flags picks the algorithm.
+static inline uint32_t superblock_crc_finalize(superblock_t *sb) {
+    sb->checksum = 0;
+    uint32_t s = mvsfs_crc(sb->flags, (void *) sb, BS - 4);
+    sb->checksum = s;
+    return s;
+}
+
+// flags: the image's superblock flags.
+static inline void inode_crc_finalize(inode_t* ino, uint32_t flags){
+    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
+    memset(&tmp[120], 0, 8);
+    uint32_t c = mvsfs_crc(flags, tmp, 120);
+    ino->inode_crc = (uint64_t)c;
+}
+
+static inline void dirent_checksum_finalize(dirent64_t* de) {
+    const uint8_t* p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) x ^= p[i];
+    de->checksum = x;
+}
+// For whole directory blocks, see dirent_block_bad() and dirent_block_finalize().
+
+#define DIRENTS_PER_BLOCK (BS / sizeof(dirent64_t))
+
+/*
+ * Hashed directories. A directory with INODE_F_HASHDIR has a power-of-two
+ * number of blocks (size_bytes / BS), each a bucket of 64 dirents. An entry
+ * lives in the first bucket, probing from hash(name) % nbuckets, that had a
+ * free slot when it was inserted; the adder grows and rehashes the directory
+ * rather than probe more than DIR_HASH_PROBES buckets. Entries are never
+ * removed, so a lookup can stop at the first bucket with a free slot, and
+ * reads at most DIR_HASH_PROBES blocks. "." and ".." are always the first two
+ * slots of bucket 0. Directories without the flag are the original linear
+ * layout: size_bytes / 64 entries in direct[0].
+ */
+#define DIR_HASH_PROBES 4u
+#define DIR_HASH_MIN_BUCKETS 4u    // size of a linear directory converted on overflow
+
+// FNV-1a over the name up to its terminating NUL (at most 58 bytes).
+static inline uint32_t dirent_name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 58 && name[i]; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Fills a zeroed 58-byte dirent name; names are truncated to 57 bytes.
+static inline void dirent_name(char out[58], const char *name) {
+    size_t name_len = strlen(name);
+    if (name_len > 57) name_len = 57;
+    memset(out, 0, 58);
+    memcpy(out, name, name_len);
+}
+
+// Checksum table entry of data index d; only for images with MVSFS_FEAT_DATACSUM. base is the mapped image.
+static inline uint32_t *data_csum_entry(const uint8_t *base, uint64_t d) {
+    return (uint32_t *)(base + superblock_ext((void *)base)->csum_start * BS) + d;
+}
+
+// Whether block is a data block (of any group). base is the mapped image.
+static inline int block_in_data_region(const uint8_t *base, const superblock_t *sb, uint64_t block) {
+    if (block < sb->data_region_start) return 0;
+    uint64_t d = block - sb->data_region_start;
+    if (!(sb->flags & MVSFS_FEAT_GROUPS)) return d < sb->data_region_blocks;
+    mvsfs_groups_t gr = mvsfs_groups(sb, base);
+    uint64_t g = d / gr.stride;
+    return g < gr.count && d % gr.stride < group_data_blocks(sb, &gr, g);
+}
+
+// Block of the inode table holding inode ino.
+static inline uint64_t inode_table_block(const uint8_t *base, const superblock_t *sb, uint64_t ino) {
+    uint64_t i = ino - 1;
+    if (!(sb->flags & MVSFS_FEAT_GROUPS)) return sb->inode_table_start + i / (BS / INODE_SIZE);
+    mvsfs_groups_t gr = mvsfs_groups(sb, base);
+    return sb->inode_table_start + i / gr.inodes_per_group * gr.stride + i % gr.inodes_per_group / (BS / INODE_SIZE);
+}
+
+// Inode ino (1-based, at most inode_count) in the mapped image.
+static inline inode_t *inode_ptr(const uint8_t *base, const superblock_t *sb, uint64_t ino) {
+    uint64_t i = ino - 1;
+    if (sb->flags & MVSFS_FEAT_GROUPS) i %= mvsfs_groups(sb, base).inodes_per_group;
+    return (inode_t *)(base + inode_table_block(base, sb, ino) * BS) + i % (BS / INODE_SIZE);
+}
+
+/*
+ * Absolute block number holding block k of an inode, or 0 for a hole or a
+ * pointer that falls outside the data region. base is the mapped image.
+ */
+static inline uint32_t inode_bmap(const uint8_t *base, const superblock_t *sb, const inode_t *ino, uint64_t k) {
+    if (k < N_DIRECT) return block_in_data_region(base, sb, ino->direct[k]) ? ino->direct[k] : 0;
+    k -= N_DIRECT;
+    uint32_t ind;
+    if (k < PTRS_PER_BLOCK) {
+        ind = ino->reserved_1;
+    } else {
+        k -= PTRS_PER_BLOCK;
+        if (k / PTRS_PER_BLOCK >= PTRS_PER_BLOCK || !block_in_data_region(base, sb, ino->reserved_2)) return 0;
+        const uint32_t *dbl = (const uint32_t *)(base + (uint64_t)ino->reserved_2 * BS);
+        ind = dbl[k / PTRS_PER_BLOCK];
+        k %= PTRS_PER_BLOCK;
+    }
+    if (!block_in_data_region(base, sb, ind)) return 0;
+    uint32_t b = ((const uint32_t *)(base + (uint64_t)ind * BS))[k];
+    return block_in_data_region(base, sb, b) ? b : 0;
+}
+
+/*
+ * Copies len bytes starting at byte off of an inode's blocks, as stored (no
+ * decompression). Returns -1 if any of those blocks is unmapped.
+ */
+static inline int inode_read_raw(const uint8_t *base, const superblock_t *sb, const inode_t *ino,
+                                 uint64_t off, uint8_t *out, uint64_t len) {
+    while (len > 0) {
+        uint32_t b = inode_bmap(base, sb, ino, off / BS);
+        if (!b) return -1;
+        uint64_t n = BS - off % BS < len ? BS - off % BS : len;
+        memcpy(out, base + (uint64_t)b * BS + off % BS, n);
+        out += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static inline int dir_is_hashed(const inode_t *dir) {
+    return (dir->reserved_0 & INODE_F_HASHDIR) != 0;
+}
+
+// Number of dirent slots in use or reservable in a directory.
+static inline uint64_t dir_slot_count(const inode_t *dir) {
+    return dir_is_hashed(dir) ? dir->size_bytes / BS * DIRENTS_PER_BLOCK
+                              : dir->size_bytes / sizeof(dirent64_t);
+}
+
+// Slot i of a directory (bucket i / 64, entry i % 64), or NULL if unmapped.
+static inline dirent64_t *dir_slot(const uint8_t *base, const superblock_t *sb, const inode_t *dir, uint64_t i) {
+    uint32_t b = inode_bmap(base, sb, dir, i / DIRENTS_PER_BLOCK);
+    return b ? (dirent64_t *)(base + (uint64_t)b * BS) + i % DIRENTS_PER_BLOCK : NULL;
+}
+
+// Finds name (zero-padded to 58 bytes) in a directory; NULL if absent.
+static inline dirent64_t *dir_lookup(const uint8_t *base, const superblock_t *sb, const inode_t *dir,
+                                     const char name[58]) {
+    if (!dir_is_hashed(dir)) {
+        uint64_t n = dir_slot_count(dir);
+        if (n > DIRENTS_PER_BLOCK) n = DIRENTS_PER_BLOCK;
+        for (uint64_t i = 0; i < n; i++) {
+            dirent64_t *de = dir_slot(base, sb, dir, i);
+            if (de && de->inode_no != 0 && memcmp(de->name, name, 58) == 0) return de;
+        }
+        return NULL;
+    }
+    uint64_t nbuckets = dir->size_bytes / BS;
+    if (nbuckets == 0 || (nbuckets & (nbuckets - 1))) return NULL;
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        dirent64_t *de = dir_slot(base, sb, dir, name[1] == '\0' ? 0 : 1);
+        return de && memcmp(de->name, name, 58) == 0 ? de : NULL;
+    }
+    uint32_t h = dirent_name_hash(name);
+    for (uint64_t p = 0; p < DIR_HASH_PROBES && p < nbuckets; p++) {
+        uint32_t b = inode_bmap(base, sb, dir, (h + p) & (nbuckets - 1));
+        if (!b) return NULL;
+        dirent64_t *bucket = (dirent64_t *)(base + (uint64_t)b * BS);
+        int has_free = 0;
+        for (uint64_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            if (bucket[i].inode_no == 0) has_free = 1;
+            else if (memcmp(bucket[i].name, name, 58) == 0) return &bucket[i];
+        }
+        if (has_free) return NULL;
+    }
+    return NULL;
+}
+
+// Number of indirect blocks needed to map a file of nblocks data blocks.
+static inline uint64_t indirect_blocks_for(uint64_t nblocks) {
+    if (nblocks <= N_DIRECT) return 0;
+    nblocks -= N_DIRECT;
+    if (nblocks <= PTRS_PER_BLOCK) return 1;
+    nblocks -= PTRS_PER_BLOCK;
+    return 2 + (nblocks + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+}
+
+#endif
@@ -1,404 +1,1786 @@
-#define _FILE_OFFSET_BITS 64
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <string.h>
-#include <inttypes.h>
-#include <errno.h>
-#include <time.h>
-#include <assert.h>
-#include <getopt.h>
-#include <unistd.h>
-#include <fcntl.h>
-
-#define BS 4096u
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
-
-#pragma pack(push, 1)
-typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    uint32_t block_size;
-    uint64_t total_blocks;
-    uint64_t inode_count;
-    uint64_t inode_bitmap_start;
-    uint64_t inode_bitmap_blocks;
-    uint64_t data_bitmap_start;
-    uint64_t data_bitmap_blocks;
-    uint64_t inode_table_start;
-    uint64_t inode_table_blocks;
-    uint64_t data_region_start;
-    uint64_t data_region_blocks;
-    uint64_t root_inode;
-    uint64_t mtime_epoch;
-    uint32_t flags;
-    uint32_t checksum;
-} superblock_t;
-#pragma pack(pop)
-
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
-
-#pragma pack(push,1)
-typedef struct {
-    uint16_t mode;
-    uint16_t links;
-    uint32_t uid;
-    uint32_t gid;
-    uint64_t size_bytes;
-    uint64_t atime;
-    uint64_t mtime;
-    uint64_t ctime;
-    uint32_t direct[12];
-    uint32_t reserved_0;
-    uint32_t reserved_1;
-    uint32_t reserved_2;
-    uint32_t proj_id;
-    uint32_t uid16_gid16;
-    uint64_t xattr_ptr;
-    uint64_t inode_crc;
-} inode_t;
-#pragma pack(pop)
-
-_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
-
-#pragma pack(push,1)
-typedef struct {
-    uint32_t inode_no;
-    uint8_t type;
-    char name[58];
-    uint8_t checksum;
-} dirent64_t;
-#pragma pack(pop)
-
-_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
-
-uint32_t CRC32_TAB[256];
-
-void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
-    }
-}
-
-uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
-}
-
-
-
-void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c;
-}
-
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];
-    de->checksum = x;
-}
-
-int find_free_inode(uint8_t *bitmap, uint64_t inode_count) {
-    for (uint64_t initial = 0; initial < inode_count; initial++) {
-        if (!(bitmap[initial / 8] & (1 << (initial % 8)))) {
-            return initial + 1; 
-        }
-    }
-    return -1;
-}
-
-int find_free_data_block(uint8_t *bitmap, uint64_t data_blocks) {
-    for (uint64_t initial = 0; initial < data_blocks; initial++) {
-        if (!(bitmap[initial / 8] & (1 << (initial % 8)))) {
-            return initial;
-        }
-    }
-    return -1;
-}
-
-void usage() {
-    fprintf(stderr, "Usage: mkfs_adder --input <input.img> --output <output.img> --file <filename>\n");
-}
-
-int main(int argc, char *argv[]) {
-    crc32_init();
-    
-    char *input_name = NULL;
-    char *output_name = NULL;
-    char *file_name = NULL;
-    
-    static struct option long_options[] = {
-        {"input", required_argument, 0, 'i'},
-        {"output", required_argument, 0, 'o'},
-        {"file", required_argument, 0, 'f'},
-        {0, 0, 0, 0}
-    };
-    
-    int opt;
-    while ((opt = getopt_long(argc, argv, "i:o:f:", long_options, NULL)) != -1) {
-        switch (opt) {
-            case 'i': input_name = optarg; break;
-            case 'o': output_name = optarg; break;
-            case 'f': file_name = optarg; break;
-            default: 
-                usage();
-                exit(EXIT_FAILURE);
-        }
-    }
-    
-    if (!input_name || !output_name || !file_name) {
-        usage();
-        exit(EXIT_FAILURE);
-    }
-    
-    // Open input file
-    FILE *fp_in = fopen(input_name, "rb");
-    if (!fp_in) {
-        perror("Failed to open input image");
-        exit(EXIT_FAILURE);
-    }
-    
-    
-    superblock_t sb;
-    if (fread(&sb, sizeof(sb), 1, fp_in) != 1) {
-        perror("Failed to read superblock");
-        fclose(fp_in);
-        exit(EXIT_FAILURE);
-    }
-    
-    
-    if (sb.magic != 0x4D565346) {
-        fprintf(stderr, "Invalid file system magic number\n");
-        fclose(fp_in);
-        exit(EXIT_FAILURE);
-    }
-    
-    
-    uint8_t inode_bitmap[BS];
-    fseek(fp_in, sb.inode_bitmap_start * BS, SEEK_SET);
-    if (fread(inode_bitmap, BS, 1, fp_in) != 1) {
-        perror("Failed to read inode bitmap");
-        fclose(fp_in);
-        exit(EXIT_FAILURE);
-    }
-    
-    
-    uint8_t data_bitmap[BS];
-    fseek(fp_in, sb.data_bitmap_start * BS, SEEK_SET);
-    if (fread(data_bitmap, BS, 1, fp_in) != 1) {
-        perror("Failed to read data bitmap");
-        fclose(fp_in);
-        exit(EXIT_FAILURE);
-    }
-    
-    
-    uint8_t *inode_table = malloc(sb.inode_table_blocks * BS);
-    fseek(fp_in, sb.inode_table_start * BS, SEEK_SET);
-    if (fread(inode_table, sb.inode_table_blocks * BS, 1, fp_in) != 1) {
-        perror("Failed to read inode table");
-        free(inode_table);
-        fclose(fp_in);
-        exit(EXIT_FAILURE);
-    }
-    
-printf("Data region start: %" PRIu64 " blocks\n", sb.data_region_start);
-printf("Data region blocks: %" PRIu64 " blocks\n", sb.data_region_blocks);
-printf("File position before seeking: %ld\n", ftell(fp_in));
-
-fseek(fp_in, sb.data_region_start * BS, SEEK_SET);
-printf("File position after seeking: %ld\n", ftell(fp_in));
-
-
-uint8_t *data_region = malloc(sb.data_region_blocks * BS);
-if (fread(data_region, sb.data_region_blocks * BS, 1, fp_in) != 1) {
-    perror("Failed to read data region");
-    printf("Error code: %d\n", errno);
-    printf("Tried to read %" PRIu64 " bytes\n", sb.data_region_blocks * BS);
-    printf("File size: %ld bytes\n", ftell(fp_in));
-    free(inode_table);
-    free(data_region);
-    fclose(fp_in);
-    exit(EXIT_FAILURE);
-}
-    
-    fclose(fp_in);
-    
-    
-    int free_inode = find_free_inode(inode_bitmap, sb.inode_count);
-    if (free_inode == -1) {
-        fprintf(stderr, "Sorry.No free inodes available\n");
-        free(inode_table);
-        free(data_region);
-        exit(EXIT_FAILURE);
-    }
-    
-    
-    FILE *file_fp = fopen(file_name, "rb");
-    if (!file_fp) {
-        perror("Failed to open file to add");
-        free(inode_table);
-        free(data_region);
-        exit(EXIT_FAILURE);
-    }
-    
-    
-    fseek(file_fp, 0, SEEK_END);
-    uint64_t file_size = ftell(file_fp);
-    fseek(file_fp, 0, SEEK_SET);
-    
-    
-    uint64_t needed_blocks = (file_size + BS - 1) / BS;
-    if (needed_blocks > 12) {
-        fprintf(stderr, "File too large - exceeds 12 direct blocks\n");
-        fclose(file_fp);
-        free(inode_table);
-        free(data_region);
-        exit(EXIT_FAILURE);
-    }
-    
-    // Find free data blocks
-    uint32_t data_blocks[12] = {0};
-    for (uint64_t initial = 0; initial < needed_blocks; initial++) {
-        int free_block = find_free_data_block(data_bitmap, sb.data_region_blocks);
-        if (free_block == -1) {
-            fprintf(stderr, "Not enough free data blocks\n");
-            fclose(file_fp);
-            free(inode_table);
-            free(data_region);
-            exit(EXIT_FAILURE);
-        }
-        data_blocks[initial] = sb.data_region_start + free_block;
-        data_bitmap[free_block / 8] |= (1 << (free_block % 8));
-    }
-    
-    // Read file content
-    uint8_t *file_content = malloc(file_size);
-    if (fread(file_content, file_size, 1, file_fp) != 1) {
-        perror("Failed to read file content");
-        fclose(file_fp);
-        free(inode_table);
-        free(data_region);
-        free(file_content);
-        exit(EXIT_FAILURE);
-    }
-    fclose(file_fp);
-    
-    // Write file content to data blocks
-    for (uint64_t initial = 0; initial < needed_blocks; initial++) {
-        uint64_t offset = (data_blocks[initial] - sb.data_region_start) * BS;
-        uint64_t copy_size = (initial == needed_blocks - 1) ? 
-            file_size - (initial * BS) : BS;
-        memcpy(data_region + offset, file_content + (initial * BS), copy_size);
-    }
-    free(file_content);
-    
-    // Create new inode
-    inode_t *new_inode = (inode_t *)(inode_table + (free_inode - 1) * INODE_SIZE);
-    time_t now = time(NULL);
-    
-    new_inode->mode = 0x8000; // Regular file
-    new_inode->links = 1;
-    new_inode->uid = 0;
-    new_inode->gid = 0;
-    new_inode->size_bytes = file_size;
-    new_inode->atime = now;
-    new_inode->mtime = now;
-    new_inode->ctime = now;
-    for (uint64_t initial = 0; initial < 12; initial++) {
-        new_inode->direct[initial] = (initial < needed_blocks) ? data_blocks[initial] : 0;
-    }
-    new_inode->proj_id = 1234;
-    inode_crc_finalize(new_inode);
-    
-
-    inode_bitmap[(free_inode - 1) / 8] |= (1 << ((free_inode - 1) % 8));
-    
-    
-    inode_t *root_inode = (inode_t *)inode_table;
-    uint32_t root_data_block = root_inode->direct[0] - sb.data_region_start;
-    dirent64_t *root_entries = (dirent64_t *)(data_region + root_data_block * BS);
-    
-    
-    int free_entry = -1;
-    uint64_t entry_count = root_inode->size_bytes / sizeof(dirent64_t);
-    for (uint64_t i = 0; i < entry_count; i++) {
-        if (root_entries[i].inode_no == 0) {
-            free_entry = i;
-            break;
-        }
-    }
-    
-    if (free_entry == -1) {
-    
-        if (entry_count >= (BS / sizeof(dirent64_t))) {
-            fprintf(stderr, "Root directory is full\n");
-            free(inode_table);
-            free(data_region);
-            exit(EXIT_FAILURE);
-        }
-        
-        free_entry = entry_count;
-        root_inode->size_bytes += sizeof(dirent64_t);
-        inode_crc_finalize(root_inode);
-    }
-    
-    // Create directory entry
-    root_entries[free_entry].inode_no = free_inode;
-    root_entries[free_entry].type = 1; // File
-    
-    
-    size_t name_len = strlen(file_name);
-    if (name_len > 57) name_len = 57; 
-    memset(root_entries[free_entry].name, 0, 58);
-    strncpy(root_entries[free_entry].name, file_name, name_len);
-    root_entries[free_entry].name[name_len] = '\0';
-    
-    dirent_checksum_finalize(&root_entries[free_entry]);
-    
-    root_inode->links++;
-    inode_crc_finalize(root_inode);
-    
-    // Write output file
-    FILE *fp_out = fopen(output_name, "wb");
-    if (!fp_out) {
-        perror("Failed to create output image");
-        free(inode_table);
-        free(data_region);
-        exit(EXIT_FAILURE);
-    }
-    
-
-    fwrite(&sb, sizeof(sb), 1, fp_out);
-    
-
-    fseek(fp_out, sb.inode_bitmap_start * BS, SEEK_SET);
-    fwrite(inode_bitmap, BS, 1, fp_out);
-    
-    
-    fseek(fp_out, sb.data_bitmap_start * BS, SEEK_SET);
-    fwrite(data_bitmap, BS, 1, fp_out);
-    
-
-    fseek(fp_out, sb.inode_table_start * BS, SEEK_SET);
-    fwrite(inode_table, sb.inode_table_blocks * BS, 1, fp_out);
-    
-    
-    fseek(fp_out, sb.data_region_start * BS, SEEK_SET);
-    fwrite(data_region, sb.data_region_blocks * BS, 1, fp_out);
-    
-    fclose(fp_out);
-    free(inode_table);
-    free(data_region);
-    
-    printf("File '%s' added successfully to inode %d\n", file_name, free_inode);
-    printf("Output image: %s\n", output_name);
-    
-    return 0;
-}
\ No newline at end of file
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "minivsfs.h"
+#include "bitmap_alloc.h"
+#include "extent_alloc.h"
+#include "dedup_index.h"
+#include "compress.h"
+
+#define BITS_PER_BLOCK ((uint64_t)BS * 8)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define CSUM_READ_BLOCKS 64u
+
+/*
+ * Directories already resolved during this run, keyed by (parent inode,
+ * name), so that walking the same path prefix for every file of a deep tree
+ * costs one hash probe per component instead of a directory block lookup.
+ * Open addressing with linear probing; ino == 0 marks an empty slot.
+ */
+typedef struct {
+    uint32_t parent;
+    uint32_t ino;
+    char name[58];
+} dcache_entry_t;
+
+typedef struct {
+    dcache_entry_t *slots;
+    size_t cap;     // power of two
+    size_t count;
+} dcache_t;
+
+/*
+ * The image being edited is mapped MAP_SHARED and the allocators below work
+ * straight on its bitmaps, so only the pages actually touched are ever read.
+ * A separate --output is first copied from the input and then edited in
+ * place. File data never goes through the mapping: it is streamed from the
+ * host file to the image fd. If the file cannot be mapped, the image is read
+ * into a heap buffer instead and metadata edits are written back from the
+ * dirty map.
+ *
+ * With MVSFS_FEAT_DATACSUM, file data is checksummed by reading it back once
+ * it has been streamed, and directory and indirect blocks, which are edited
+ * in memory, when the image is committed (image_sync_csums).
+ */
+typedef struct {
+    superblock_t sb;
+    int fd;
+    int in_place;
+    int mapped;
+    uint8_t *base;
+    uint64_t size;
+    uint8_t *dirty;     // one bit per image block changed since load
+    mvsfs_groups_t groups;
+    bitmap_t *inodes;   // per allocation group, over the mapped bitmap slices
+    bitmap_t *blocks;
+    extent_index_t *extents;
+    uint64_t *group_free;   // free data blocks per group at load
+    uint64_t next_dir_group;
+    superblock_ext_t counters;  // free counts at load; the bitmaps' used_delta tracks changes since
+    dcache_t dcache;
+    int dedup;          // --dedup: share blocks through 'index'
+    dedup_index_t index;
+    uint64_t blocks_saved;
+    int compress;       // --compress: store files compressed where that saves blocks
+    uint64_t files_compressed;
+    uint64_t blocks_compressed_away;
+} image_t;
+
+typedef struct {
+    char *host_path;
+    char *name;     // target path; a name without '/' goes into the root directory
+} add_spec_t;
+
+typedef struct {
+    add_spec_t *items;
+    size_t count;
+    size_t cap;
+} add_list_t;
+
+void usage() {
+    fprintf(stderr, "Usage: mkfs_adder --input <input.img> {--output <output.img> | --in-place} "
+                    "{--file <filename> [--dest <dir>]}... [--manifest <list>]\n");
+    fprintf(stderr, "  --file: may be repeated; each file is added to / under its own name\n");
+    fprintf(stderr, "  --dest: directory for the preceding --file, e.g. /a/b/c; missing directories are created\n");
+    fprintf(stderr, "  --manifest: one host path per line, optionally followed by the target path\n");
+    fprintf(stderr, "  --in-place: update --input directly, writing only the changed blocks\n");
+    fprintf(stderr, "  --alloc-policy: first-fit (default) or best-fit choice of free extent per file\n");
+    fprintf(stderr, "  --dedup: store each distinct 4 KiB block once, indexed in <image>.dedup\n");
+    fprintf(stderr, "  --compress: store files compressed when that takes fewer blocks\n");
+}
+
+int add_list_push(add_list_t *list, const char *host_path, const char *name) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 16;
+        add_spec_t *items = realloc(list->items, cap * sizeof(*items));
+        if (!items) {
+            perror("Failed to grow file list");
+            return -1;
+        }
+        list->items = items;
+        list->cap = cap;
+    }
+    add_spec_t *spec = &list->items[list->count];
+    spec->host_path = strdup(host_path);
+    spec->name = strdup(name);
+    if (!spec->host_path || !spec->name) {
+        perror("Failed to copy file name");
+        free(spec->host_path);
+        free(spec->name);
+        return -1;
+    }
+    list->count++;
+    return 0;
+}
+
+// Default target name of a host file: its last path component.
+const char *host_basename(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// Places the most recently added file in directory dest, keeping its name.
+int add_list_set_dest(add_list_t *list, const char *dest) {
+    if (list->count == 0) {
+        fprintf(stderr, "--dest must follow the --file it applies to\n");
+        return -1;
+    }
+    add_spec_t *spec = &list->items[list->count - 1];
+    const char *slash = strrchr(spec->name, '/');
+    const char *leaf = slash ? slash + 1 : spec->name;
+    int dest_len = strlen(dest);
+    while (dest_len > 0 && dest[dest_len - 1] == '/') dest_len--;
+    size_t len = dest_len + 1 + strlen(leaf) + 1;
+    char *name = malloc(len);
+    if (!name) {
+        perror("Failed to copy file name");
+        return -1;
+    }
+    snprintf(name, len, "%.*s/%s", dest_len, dest, leaf);
+    free(spec->name);
+    spec->name = name;
+    return 0;
+}
+
+void add_list_free(add_list_t *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->items[i].host_path);
+        free(list->items[i].name);
+    }
+    free(list->items);
+}
+
+// Manifest lines are "<host path> [target path]"; blank lines and '#' comments are skipped.
+int read_manifest(const char *path, add_list_t *list) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror("Failed to open manifest");
+        return -1;
+    }
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    unsigned long line_no = 0;
+    int rc = 0;
+    while ((len = getline(&line, &line_cap, fp)) != -1) {
+        line_no++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' ||
+                           line[len - 1] == ' ' || line[len - 1] == '\t')) {
+            line[--len] = '\0';
+        }
+        char *host = line;
+        while (*host == ' ' || *host == '\t') host++;
+        if (*host == '\0' || *host == '#') continue;
+
+        char *name = host + strcspn(host, " \t");
+        if (*name) {
+            *name++ = '\0';
+            while (*name == ' ' || *name == '\t') name++;
+        }
+        if (add_list_push(list, host, *name ? name : host_basename(host)) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    if (rc == 0 && ferror(fp)) {
+        fprintf(stderr, "Failed to read manifest %s at line %lu\n", path, line_no);
+        rc = -1;
+    }
+    free(line);
+    fclose(fp);
+    return rc;
+}
+
+void mark_dirty(image_t *img, uint64_t block) {
+    img->dirty[block / 8] |= (1 << (block % 8));
+}
+
+void mark_clean(image_t *img, uint64_t block) {
+    img->dirty[block / 8] &= ~(1 << (block % 8));
+}
+
+/*
+ * Inodes are numbered image-wide, and data blocks are addressed by their data
+ * index (block - data_region_start). Inode index i lives in group
+ * i / inodes_per_group; data index d in group d / stride, at bit d % stride
+ * of that group's bitmap.
+ */
+uint64_t inode_group(const image_t *img, uint64_t ino) {
+    return (ino - 1) / img->groups.inodes_per_group;
+}
+
+uint64_t data_group(const image_t *img, uint64_t idx) {
+    return idx / img->groups.stride;
+}
+
+// Marks the inode bitmap block that holds inode index 'idx'.
+void mark_inode_bit_dirty(image_t *img, uint64_t idx) {
+    uint64_t g = idx / img->groups.inodes_per_group;
+    mark_dirty(img, img->sb.inode_bitmap_start + g * img->groups.stride +
+                    idx % img->groups.inodes_per_group / BITS_PER_BLOCK);
+}
+
+// Marks the data bitmap block that holds data index 'idx'.
+void mark_data_bit_dirty(image_t *img, uint64_t idx) {
+    mark_dirty(img, img->sb.data_bitmap_start + data_group(img, idx) * img->groups.stride +
+                    idx % img->groups.stride / BITS_PER_BLOCK);
+}
+
+int data_block_used(const image_t *img, uint64_t idx) {
+    return bitmap_test(&img->blocks[data_group(img, idx)], idx % img->groups.stride);
+}
+
+void mark_inode_dirty(image_t *img, uint64_t ino) {
+    mark_dirty(img, inode_table_block(img->base, &img->sb, ino));
+}
+
+uint8_t *image_block(image_t *img, uint64_t block) {
+    return img->base + block * BS;
+}
+
+inode_t *inode_at(image_t *img, uint64_t ino) {
+    return inode_ptr(img->base, &img->sb, ino);
+}
+
+/*
+ * Writes back only the dirty blocks, coalescing adjacent ones into a single
+ * pwritev() (up to IOV_MAX blocks per call). Returns the number of blocks
+ * written, or -1 on error.
+ */
+int64_t write_dirty_blocks(image_t *img, int fd, uint64_t *calls) {
+    struct iovec iov[IOV_MAX];
+    int64_t written = 0;
+    uint64_t total = img->sb.total_blocks;
+    *calls = 0;
+    for (uint64_t block = 0; block < total; ) {
+        if (!(img->dirty[block / 8] & (1 << (block % 8)))) {
+            block++;
+            continue;
+        }
+        uint64_t start = block;
+        int count = 0;
+        while (block < total && count < IOV_MAX && (img->dirty[block / 8] & (1 << (block % 8)))) {
+            iov[count].iov_base = image_block(img, block);
+            iov[count].iov_len = BS;
+            count++;
+            block++;
+        }
+        off_t offset = (off_t)start * BS;
+        size_t remaining = (size_t)count * BS;
+        struct iovec *cur = iov;
+        int cur_count = count;
+        while (remaining > 0) {
+            ssize_t n = pwritev(fd, cur, cur_count, offset);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("Failed to write dirty blocks");
+                return -1;
+            }
+            (*calls)++;
+            offset += n;
+            remaining -= n;
+            // Short write: skip the iovecs (or part of one) already written.
+            while (n > 0 && (size_t)n >= cur->iov_len) {
+                n -= cur->iov_len;
+                cur++;
+                cur_count--;
+            }
+            if (n > 0) {
+                cur->iov_base = (uint8_t *)cur->iov_base + n;
+                cur->iov_len -= n;
+            }
+        }
+        written += count;
+    }
+    return written;
+}
+
+// Sets the checksum table entry of data block 'block' from its content.
+void csum_update(image_t *img, uint64_t block, const uint8_t *data) {
+    uint64_t idx = block - img->sb.data_region_start;
+    *data_csum_entry(img->base, idx) = crc32c(data, BS);
+    mark_dirty(img, superblock_ext(img->base)->csum_start + idx / CSUM_PER_BLOCK);
+}
+
+// Checksums the dirty blocks of the data region: directory and indirect blocks edited in memory.
+void image_sync_csums(image_t *img) {
+    if (!(img->sb.flags & MVSFS_FEAT_DATACSUM)) return;
+    uint64_t end = superblock_ext(img->base)->csum_start;
+    for (uint64_t b = img->sb.data_region_start; b < end; b++) {
+        if (!img->dirty[b / 8]) {
+            b |= 7;
+            continue;
+        }
+        if ((img->dirty[b / 8] & (1 << (b % 8))) && block_in_data_region(img->base, &img->sb, b))
+            csum_update(img, b, image_block(img, b));
+    }
+}
+
+int check_layout(const uint8_t *block0, uint64_t file_size) {
+    const char *err = superblock_layout_error((const superblock_t *)block0, block0, file_size);
+    if (err) {
+        fprintf(stderr, "Image layout in superblock is inconsistent with the image size (%s)\n", err);
+        return -1;
+    }
+    return 0;
+}
+
+void image_free_groups(image_t *img) {
+    for (uint64_t g = 0; img->inodes && g < img->groups.count; g++) bitmap_summary_free(&img->inodes[g]);
+    for (uint64_t g = 0; img->extents && g < img->groups.count; g++) extent_index_free(&img->extents[g]);
+    free(img->inodes);
+    free(img->blocks);
+    free(img->extents);
+    free(img->group_free);
+}
+
+/*
+ * Sets up one inode allocator, data allocator and extent index per group.
+ * Free counts come from the superblock counters when they can be trusted;
+ * otherwise the bitmaps are counted once (and the counters kept from then on).
+ */
+int image_load_groups(image_t *img, extent_policy_t policy) {
+    const superblock_t *sb = &img->sb;
+    mvsfs_groups_t *gr = &img->groups;
+    *gr = mvsfs_groups(sb, image_block(img, 0));
+    img->inodes = calloc(gr->count, sizeof(*img->inodes));
+    img->blocks = calloc(gr->count, sizeof(*img->blocks));
+    img->extents = calloc(gr->count, sizeof(*img->extents));
+    img->group_free = calloc(gr->count, sizeof(*img->group_free));
+    if (!img->inodes || !img->blocks || !img->extents || !img->group_free) {
+        perror("Failed to allocate group allocators");
+        return -1;
+    }
+    for (uint64_t g = 0; g < gr->count; g++) {
+        bitmap_init(&img->inodes[g], image_block(img, sb->inode_bitmap_start + g * gr->stride),
+                    group_inodes(sb, gr, g));
+        bitmap_init(&img->blocks[g], image_block(img, sb->data_bitmap_start + g * gr->stride),
+                    group_data_blocks(sb, gr, g));
+        if (extent_index_build(&img->extents[g], &img->blocks[g], policy) != 0) {
+            perror("Failed to index free data blocks");
+            return -1;
+        }
+    }
+
+    const superblock_ext_t *ext = superblock_ext(image_block(img, 0));
+    int trusted = (sb->flags & MVSFS_FEAT_COUNTERS) && superblock_ext_valid(sb, ext);
+    img->counters = (superblock_ext_t){ .free_inodes = sb->inode_count, .free_blocks = sb->data_region_blocks };
+    if (trusted) {
+        img->counters.free_inodes = ext->free_inodes;
+        img->counters.free_blocks = ext->free_blocks;
+        img->counters.inode_hint = ext->inode_hint;
+        img->counters.block_hint = ext->block_hint;
+    }
+    for (uint64_t g = 0; g < gr->count; g++) {
+        if (!trusted) img->counters.free_inodes -= bitmap_count_used(&img->inodes[g]);
+        // Spreading files over groups needs each group's free count; one group is the whole region.
+        img->group_free[g] = trusted && gr->count == 1 ? img->counters.free_blocks
+                                                       : img->blocks[g].nbits - bitmap_count_used(&img->blocks[g]);
+        if (!trusted) img->counters.free_blocks -= img->blocks[g].nbits - img->group_free[g];
+    }
+
+    // Everything below the hints is in use: whole groups in front of them, then a prefix of theirs.
+    uint64_t ig = img->counters.inode_hint / gr->inodes_per_group;
+    uint64_t bg = img->counters.block_hint / gr->stride;
+    for (uint64_t g = 0; g < gr->count; g++) {
+        if (g < ig) img->inodes[g].cursor = img->inodes[g].nbits;
+        else if (g == ig) img->inodes[g].cursor = img->counters.inode_hint % gr->inodes_per_group;
+        if (g < bg) extent_index_skip(&img->extents[g], img->blocks[g].nbits);
+        else if (g == bg) extent_index_skip(&img->extents[g], img->counters.block_hint % gr->stride);
+    }
+    return 0;
+}
+
+int image_open(image_t *img, const char *path, int in_place, extent_policy_t policy) {
+    memset(img, 0, sizeof(*img));
+    img->in_place = in_place;
+    img->fd = open(path, O_RDWR);
+    if (img->fd < 0) {
+        perror("Failed to open image");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(img->fd, &st) != 0) {
+        perror("Failed to stat input image");
+        close(img->fd);
+        return -1;
+    }
+    if (pread(img->fd, &img->sb, sizeof(img->sb), 0) != (ssize_t)sizeof(img->sb)) {
+        fprintf(stderr, "Failed to read superblock\n");
+        close(img->fd);
+        return -1;
+    }
+    if (img->sb.magic != MVSFS_MAGIC) {
+        fprintf(stderr, "Invalid file system magic number\n");
+        close(img->fd);
+        return -1;
+    }
+    if (img->sb.flags & ~MVSFS_FEAT_KNOWN) {
+        fprintf(stderr, "Image uses unsupported features (flags 0x%x)\n", img->sb.flags);
+        close(img->fd);
+        return -1;
+    }
+    uint8_t *block0 = malloc(BS);
+    if (!block0 || pread(img->fd, block0, BS, 0) != BS) {
+        fprintf(stderr, "Failed to read superblock\n");
+        free(block0);
+        close(img->fd);
+        return -1;
+    }
+    int layout = check_layout(block0, st.st_size);
+    free(block0);
+    if (layout != 0) {
+        close(img->fd);
+        return -1;
+    }
+
+    img->size = img->sb.total_blocks * BS;
+    img->base = mmap(NULL, img->size, PROT_READ | PROT_WRITE, MAP_SHARED, img->fd, 0);
+    if (img->base != MAP_FAILED) {
+        img->mapped = 1;
+    } else {
+        img->base = malloc(img->size);
+        if (!img->base) {
+            perror("Failed to allocate image buffer");
+            close(img->fd);
+            return -1;
+        }
+        for (uint64_t done = 0; done < img->size; ) {
+            ssize_t n = pread(img->fd, img->base + done, img->size - done, done);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) continue;
+                perror("Failed to read image");
+                free(img->base);
+                close(img->fd);
+                return -1;
+            }
+            done += n;
+        }
+    }
+
+    img->dirty = calloc((img->sb.total_blocks + 7) / 8, 1);
+    if (!img->dirty) {
+        perror("Failed to allocate dirty map");
+        if (img->mapped) munmap(img->base, img->size); else free(img->base);
+        close(img->fd);
+        return -1;
+    }
+
+    int rc = image_load_groups(img, policy);
+    if (rc == 0 && !block_in_data_region(img->base, &img->sb, inode_at(img, ROOT_INO)->direct[0])) {
+        fprintf(stderr, "Root directory block is outside the data region\n");
+        rc = -1;
+    }
+    if (rc != 0) {
+        image_free_groups(img);
+        if (img->mapped) munmap(img->base, img->size); else free(img->base);
+        free(img->dirty);
+        close(img->fd);
+        return -1;
+    }
+
+    // Every add searches the inode bitmaps; data blocks are found through the extent indexes instead.
+    // Without a summary (out of memory) the search simply scans.
+    for (uint64_t g = 0; g < img->groups.count; g++) bitmap_summary_build(&img->inodes[g]);
+    return 0;
+}
+
+void image_close(image_t *img) {
+    dedup_free(&img->index);
+    free(img->dcache.slots);
+    image_free_groups(img);
+    if (img->mapped) munmap(img->base, img->size); else free(img->base);
+    free(img->dirty);
+    close(img->fd);
+}
+
+/*
+ * Copies len bytes between two fds at explicit offsets without a user-space
+ * buffer where the kernel allows it: copy_file_range() first, then
+ * sendfile(), and only then a bounded pread()/pwrite() loop. Returns the
+ * number of bytes copied, which is short only if the source ends early.
+ */
+int64_t copy_range(int in_fd, off_t in_off, int out_fd, off_t out_off, uint64_t len) {
+    uint64_t done = 0;
+    int method = 0; // 0 = copy_file_range, 1 = sendfile, 2 = pread/pwrite
+    while (done < len) {
+        ssize_t n;
+        if (method == 0) {
+            loff_t src = in_off + done, dst = out_off + done;
+            n = copy_file_range(in_fd, &src, out_fd, &dst, len - done, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                          errno == EOPNOTSUPP || errno == EBADF)) {
+                method = 1;
+                continue;
+            }
+        } else if (method == 1) {
+            if (lseek(out_fd, out_off + done, SEEK_SET) < 0) return -1;
+            off_t src = in_off + done;
+            n = sendfile(out_fd, in_fd, &src, len - done);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                method = 2;
+                continue;
+            }
+        } else {
+            uint8_t buf[64 * 1024];
+            size_t want = len - done < sizeof(buf) ? len - done : sizeof(buf);
+            n = pread(in_fd, buf, want, in_off + done);
+            if (n > 0) {
+                for (ssize_t w = 0; w < n; ) {
+                    ssize_t m = pwrite(out_fd, buf + w, n - w, out_off + done + w);
+                    if (m < 0) {
+                        if (errno == EINTR) continue;
+                        return -1;
+                    }
+                    w += m;
+                }
+            }
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+// Creates output as a copy of input (a reflink where copy_file_range can do one).
+int image_copy(const char *input_name, const char *output_name) {
+    int in_fd = open(input_name, O_RDONLY);
+    if (in_fd < 0) {
+        perror("Failed to open input image");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(in_fd, &st) != 0) {
+        perror("Failed to stat input image");
+        close(in_fd);
+        return -1;
+    }
+    int out_fd = open(output_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror("Failed to create output image");
+        close(in_fd);
+        return -1;
+    }
+    int64_t n = copy_range(in_fd, 0, out_fd, 0, st.st_size);
+    if (n != (int64_t)st.st_size || ftruncate(out_fd, st.st_size) != 0) {
+        if (n < 0) perror("Failed to copy input image");
+        else fprintf(stderr, "Failed to copy input image\n");
+        close(in_fd);
+        close(out_fd);
+        unlink(output_name);
+        return -1;
+    }
+    close(in_fd);
+    if (close(out_fd) != 0) {
+        perror("Failed to close output image");
+        unlink(output_name);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Makes the metadata edits durable: a shared mapping already holds them,
+ * while a heap image writes back its dirty blocks.
+ */
+int image_commit(image_t *img, const char *output_name) {
+    if (img->mapped) {
+        uint64_t blocks = 0;
+        for (uint64_t b = 0; b < img->sb.total_blocks; b++)
+            if (img->dirty[b / 8] & (1 << (b % 8))) blocks++;
+        if (img->in_place) {
+            printf("Updated image in place: %s (%" PRIu64 " metadata block(s) modified)\n", output_name, blocks);
+        } else {
+            printf("Output image: %s\n", output_name);
+        }
+        return 0;
+    }
+    uint64_t calls = 0;
+    int64_t written = write_dirty_blocks(img, img->fd, &calls);
+    if (written < 0) return -1;
+    if (img->in_place) {
+        printf("Updated image in place: %s (%" PRId64 " metadata block(s) in %" PRIu64 " write(s))\n",
+               output_name, written, calls);
+    } else {
+        printf("Output image: %s\n", output_name);
+    }
+    return 0;
+}
+
+/*
+ * Streams a host file into its data blocks run by run (the blocks are
+ * contiguous within a fragment) and zeroes the unused tail of the last
+ * block. Blocks with skip[k] set (shared by dedup) are left alone. The file
+ * is never held in memory, so RSS does not depend on its size.
+ */
+int stream_file(image_t *img, int src_fd, const uint32_t *blocks, const uint8_t *skip, uint64_t nblocks,
+                uint64_t size) {
+    for (uint64_t k = 0; k < nblocks; ) {
+        if (skip && skip[k]) {
+            k++;
+            continue;
+        }
+        uint64_t run = 1;
+        while (k + run < nblocks && blocks[k + run] == blocks[k] + run && !(skip && skip[k + run])) run++;
+        uint64_t off = k * BS;
+        uint64_t len = (k + run) * BS < size ? run * BS : size - off;
+        int64_t n = copy_range(src_fd, off, img->fd, (off_t)blocks[k] * BS, len);
+        if (n != (int64_t)len) {
+            if (n < 0) perror("Failed to copy file content");
+            else fprintf(stderr, "File changed size while it was being added\n");
+            return -1;
+        }
+        k += run;
+    }
+    if (size % BS && !(skip && skip[nblocks - 1])) {
+        static const uint8_t zeros[BS];
+        uint64_t tail = BS - size % BS;
+        if (pwrite(img->fd, zeros, tail, (off_t)blocks[nblocks - 1] * BS + size % BS) != (ssize_t)tail) {
+            perror("Failed to clear last block");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+uint64_t image_free_inodes(const image_t *img) {
+    int64_t used = 0;
+    for (uint64_t g = 0; g < img->groups.count; g++) used += img->inodes[g].used_delta;
+    return img->counters.free_inodes - used;
+}
+
+uint64_t image_free_blocks(const image_t *img) {
+    int64_t used = 0;
+    for (uint64_t g = 0; g < img->groups.count; g++) used += img->blocks[g].used_delta;
+    return img->counters.free_blocks - used;
+}
+
+uint64_t group_free_blocks(const image_t *img, uint64_t g) {
+    return img->group_free[g] - img->blocks[g].used_delta;
+}
+
+/*
+ * First free index at or after hint in a set of group bitmaps, where group g
+ * starts at index g * spacing; returns 'end' if everything from hint is used.
+ */
+uint64_t first_free_from(const bitmap_t *bms, uint64_t count, uint64_t spacing, uint64_t hint, uint64_t end) {
+    for (uint64_t g = hint / spacing; g < count; g++) {
+        uint64_t from = g == hint / spacing ? hint % spacing : 0;
+        int64_t i = from < bms[g].nbits ? bitmap_scan(&bms[g], from, bms[g].nbits) : -1;
+        if (i >= 0) return g * spacing + (uint64_t)i;
+    }
+    return end;
+}
+
+/*
+ * Stores the current free counts in block 0 and sets MVSFS_FEAT_COUNTERS.
+ * Frees during the run lower the loaded hints (release_blocks, unclaim_inode),
+ * so they are still lower bounds; they are moved up to the first free bit.
+ */
+void image_sync_counters(image_t *img) {
+    const mvsfs_groups_t *gr = &img->groups;
+    superblock_t *disk_sb = (superblock_t *)image_block(img, 0);
+    superblock_ext_t *ext = superblock_ext(disk_sb);
+    superblock_ext_t now = *ext;    // keeps the group geometry
+    if (!(img->sb.flags & MVSFS_FEAT_GROUPS))
+        now.group_count = now.group_stride = now.inodes_per_group = now.blocks_per_group = 0;
+    now.free_inodes = image_free_inodes(img);
+    now.free_blocks = image_free_blocks(img);
+    now.inode_hint = first_free_from(img->inodes, gr->count, gr->inodes_per_group, img->counters.inode_hint,
+                                     img->sb.inode_count);
+    now.block_hint = first_free_from(img->blocks, gr->count, gr->stride, img->counters.block_hint,
+                                     data_index_span(&img->sb, gr));
+    if ((img->sb.flags & MVSFS_FEAT_COUNTERS) && memcmp(ext, &now, sizeof(now)) == 0) return;
+    *ext = now;
+    img->sb.flags |= MVSFS_FEAT_COUNTERS;
+    disk_sb->flags = img->sb.flags;
+    superblock_crc_finalize(disk_sb);
+    mark_dirty(img, 0);
+}
+
+// Sets a feature bit in the on-disk superblock the first time the image uses it.
+void enable_feature(image_t *img, uint32_t feature) {
+    if (img->sb.flags & feature) return;
+    superblock_t *disk_sb = (superblock_t *)image_block(img, 0);
+    img->sb.flags |= feature;
+    disk_sb->flags = img->sb.flags;
+    superblock_crc_finalize(disk_sb);
+    mark_dirty(img, 0);
+}
+
+/*
+ * Frees data blocks (data indices) allocated earlier. Their dirty bits are
+ * dropped so that a heap image never writes a stale copy over file data that
+ * is later streamed into the same blocks. The blocks may predate the run
+ * (old directory buckets), so the block hint comes down to the lowest one.
+ */
+void release_blocks(image_t *img, const uint64_t *idx, uint64_t n) {
+    uint64_t local[1024];
+    for (uint64_t k = 0; k < n; ) {
+        // Hand each group its own indices, a batch at a time.
+        uint64_t g = data_group(img, idx[k]), m = 0;
+        for (; k + m < n && m < 1024 && data_group(img, idx[k + m]) == g; m++)
+            local[m] = idx[k + m] - g * img->groups.stride;
+        extent_release(&img->extents[g], local, m);
+        k += m;
+    }
+    for (uint64_t k = 0; k < n; k++) {
+        mark_clean(img, img->sb.data_region_start + idx[k]);
+        mark_data_bit_dirty(img, idx[k]);
+        if (idx[k] < img->counters.block_hint) img->counters.block_hint = idx[k];
+    }
+}
+
+// extent_alloc in group g, turning the group's bit indices into data indices.
+uint64_t group_extent_alloc(image_t *img, uint64_t g, uint64_t n, uint64_t *out, uint64_t *fragments) {
+    uint64_t got = extent_alloc(&img->extents[g], n, out, fragments);
+    for (uint64_t k = 0; k < got; k++) out[k] += g * img->groups.stride;
+    return got;
+}
+
+/*
+ * Allocates n data blocks for an inode of group 'home'. The whole request
+ * goes into the first group with room for it, trying home first, so a file
+ * normally sits next to its inode; only when no single group has room is it
+ * spread over several. Returns how many blocks were allocated, like
+ * extent_alloc; a short count must be released by the caller.
+ */
+uint64_t image_alloc_blocks(image_t *img, uint64_t home, uint64_t n, uint64_t *out, uint64_t *fragments) {
+    const uint64_t count = img->groups.count;
+    *fragments = 0;
+    if (n == 0 || n > image_free_blocks(img)) return 0;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t g = (home + i) % count;
+        if (group_free_blocks(img, g) >= n) return group_extent_alloc(img, g, n, out, fragments);
+    }
+    uint64_t got = 0;
+    for (uint64_t i = 0; i < count && got < n; i++) {
+        uint64_t g = (home + i) % count, f;
+        uint64_t want = group_free_blocks(img, g) < n - got ? group_free_blocks(img, g) : n - got;
+        if (want == 0) continue;
+        uint64_t r = group_extent_alloc(img, g, want, out + got, &f);
+        got += r;
+        *fragments += f;
+        if (r != want) break;
+    }
+    return got;
+}
+
+uint32_t *indirect_block(image_t *img, uint32_t block) {
+    uint32_t *ptrs = (uint32_t *)image_block(img, block);
+    memset(ptrs, 0, BS);
+    mark_dirty(img, block);
+    return ptrs;
+}
+
+/*
+ * Assigns the allocated blocks (bitmap indices, in allocation order) to the
+ * file in file order, placing every indirect block directly in front of the
+ * data blocks it maps, so a contiguous allocation reads sequentially.
+ * Fills in the inode's block pointers and data_blocks[] (absolute numbers).
+ * A block already set in data_blocks[] is shared rather than allocated, as
+ * is one whose same_as[k] names an earlier block of the file.
+ */
+void map_file_blocks(image_t *img, inode_t *ino, const uint64_t *alloc, uint64_t nblocks,
+                     uint32_t *data_blocks, const uint64_t *same_as) {
+    uint32_t base = img->sb.data_region_start;
+    uint32_t *single = NULL, *dbl = NULL;
+    uint64_t pos = 0;
+    for (uint64_t k = 0; k < nblocks; k++) {
+        uint32_t *slot;
+        if (k < N_DIRECT) {
+            slot = &ino->direct[k];
+        } else if (k < N_DIRECT + PTRS_PER_BLOCK) {
+            if (k == N_DIRECT) {
+                ino->reserved_1 = base + alloc[pos++];
+                single = indirect_block(img, ino->reserved_1);
+            }
+            slot = &single[k - N_DIRECT];
+        } else {
+            uint64_t rel = k - N_DIRECT - PTRS_PER_BLOCK;
+            if (rel == 0) {
+                ino->reserved_2 = base + alloc[pos++];
+                dbl = indirect_block(img, ino->reserved_2);
+            }
+            if (rel % PTRS_PER_BLOCK == 0) {
+                dbl[rel / PTRS_PER_BLOCK] = base + alloc[pos++];
+                single = indirect_block(img, dbl[rel / PTRS_PER_BLOCK]);
+            }
+            slot = &single[rel % PTRS_PER_BLOCK];
+        }
+        if (data_blocks[k]) *slot = data_blocks[k];
+        else if (same_as && same_as[k] != k) *slot = data_blocks[same_as[k]];
+        else *slot = base + alloc[pos++];
+        data_blocks[k] = *slot;
+    }
+}
+
+// Bitmap indices of an inode's first nblocks data blocks and of its indirect blocks.
+uint64_t inode_block_indices(image_t *img, const inode_t *ino, uint64_t nblocks, uint64_t *out) {
+    const superblock_t *sb = &img->sb;
+    uint64_t n = 0;
+    for (uint64_t k = 0; k < nblocks; k++) {
+        uint32_t b = inode_bmap(img->base, sb, ino, k);
+        if (b) out[n++] = b - sb->data_region_start;
+    }
+    if (nblocks > N_DIRECT && block_in_data_region(img->base, sb, ino->reserved_1))
+        out[n++] = ino->reserved_1 - sb->data_region_start;
+    if (nblocks > N_DIRECT + PTRS_PER_BLOCK && block_in_data_region(img->base, sb, ino->reserved_2)) {
+        const uint32_t *dbl = (const uint32_t *)image_block(img, ino->reserved_2);
+        uint64_t singles = (nblocks - N_DIRECT - PTRS_PER_BLOCK + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+        for (uint64_t i = 0; i < singles; i++)
+            if (block_in_data_region(img->base, sb, dbl[i])) out[n++] = dbl[i] - sb->data_region_start;
+        out[n++] = ino->reserved_2 - sb->data_region_start;
+    }
+    return n;
+}
+
+// Free slot for name within DIR_HASH_PROBES buckets of a hashed directory, or NULL.
+dirent64_t *dir_free_slot(image_t *img, const inode_t *dir, const char name[58]) {
+    uint64_t nbuckets = dir->size_bytes / BS;
+    uint32_t h = dirent_name_hash(name);
+    for (uint64_t p = 0; p < DIR_HASH_PROBES && p < nbuckets; p++) {
+        uint32_t b = inode_bmap(img->base, &img->sb, dir, (h + p) & (nbuckets - 1));
+        dirent64_t *bucket = (dirent64_t *)image_block(img, b);
+        for (uint64_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            if (bucket[i].inode_no == 0) return &bucket[i];
+        }
+    }
+    return NULL;
+}
+
+void dir_store(image_t *img, dirent64_t *slot, const dirent64_t *entry) {
+    *slot = *entry;
+    mark_dirty(img, ((uint8_t *)slot - img->base) / BS);
+}
+
+/*
+ * Moves every entry of dir into a fresh hashed layout of at least nbuckets
+ * buckets, doubling the bucket count until no entry has to probe further
+ * than DIR_HASH_PROBES, then frees the old blocks. On failure the directory
+ * is left as it was.
+ */
+int dir_rehash(image_t *img, uint64_t dir_ino, inode_t *dir, uint64_t nbuckets) {
+    const superblock_t *sb = &img->sb;
+    uint64_t old_blocks = dir_is_hashed(dir) ? dir->size_bytes / BS : 1;
+    uint64_t old_slots = dir_slot_count(dir);
+    dirent64_t *dot = dir_slot(img->base, sb, dir, 0);
+    dirent64_t *dotdot = dir_slot(img->base, sb, dir, 1);
+    if (old_slots < 2 || !dot || !dotdot || strcmp(dot->name, ".") != 0 || strcmp(dotdot->name, "..") != 0) {
+        fprintf(stderr, "Directory does not start with '.' and '..'\n");
+        return -1;
+    }
+
+    for (; nbuckets <= MAX_FILE_BLOCKS; nbuckets *= 2) {
+        uint64_t total = nbuckets + indirect_blocks_for(nbuckets);
+        uint64_t *idx = calloc(total, sizeof(*idx));
+        uint32_t *buckets = malloc(nbuckets * sizeof(*buckets));
+        if (!idx || !buckets) {
+            perror("Failed to allocate directory block list");
+            free(idx);
+            free(buckets);
+            return -1;
+        }
+        uint64_t fragments;
+        uint64_t got = image_alloc_blocks(img, inode_group(img, dir_ino), total, idx, &fragments);
+        if (got != total) {
+            fprintf(stderr, "Not enough free data blocks to grow the directory\n");
+            release_blocks(img, idx, got);
+            free(idx);
+            free(buckets);
+            return -1;
+        }
+
+        inode_t grown = *dir;
+        memset(grown.direct, 0, sizeof(grown.direct));
+        grown.reserved_1 = grown.reserved_2 = 0;
+        memset(buckets, 0, nbuckets * sizeof(*buckets));
+        map_file_blocks(img, &grown, idx, nbuckets, buckets, NULL);
+        for (uint64_t b = 0; b < nbuckets; b++) {
+            memset(image_block(img, buckets[b]), 0, BS);
+            mark_dirty(img, buckets[b]);
+        }
+        grown.reserved_0 |= INODE_F_HASHDIR;
+        grown.size_bytes = nbuckets * BS;
+
+        dirent64_t *bucket0 = (dirent64_t *)image_block(img, buckets[0]);
+        bucket0[0] = *dot;
+        bucket0[1] = *dotdot;
+        int fits = 1;
+        for (uint64_t i = 2; i < old_slots && fits; i++) {
+            const dirent64_t *de = dir_slot(img->base, sb, dir, i);
+            if (!de || de->inode_no == 0) continue;
+            dirent64_t *slot = dir_free_slot(img, &grown, de->name);
+            if (slot) *slot = *de; else fits = 0;
+        }
+        free(buckets);
+        if (!fits) {
+            release_blocks(img, idx, total);
+            free(idx);
+            continue;
+        }
+        for (uint64_t k = 0; k < total; k++) mark_data_bit_dirty(img, idx[k]);
+        free(idx);
+
+        uint64_t *old = calloc(old_blocks + indirect_blocks_for(old_blocks), sizeof(*old));
+        if (old) {
+            release_blocks(img, old, inode_block_indices(img, dir, old_blocks, old));
+            free(old);
+        }   // else the old blocks simply stay allocated
+        *dir = grown;
+        if (nbuckets > N_DIRECT) enable_feature(img, MVSFS_FEAT_INDIRECT);
+        enable_feature(img, MVSFS_FEAT_HASHDIR);
+        return 0;
+    }
+    fprintf(stderr, "Directory is full\n");
+    return -1;
+}
+
+/*
+ * Adds an entry to directory dir_ino. A linear directory takes it in its one
+ * block while there is room; once that is full the directory is converted to
+ * the hashed layout, which doubles whenever an insert finds no free slot
+ * within DIR_HASH_PROBES buckets. The caller has already checked that the
+ * name is not present. Every entry adds a link to dir (dir_link_child), so a
+ * directory whose link count is at UINT16_MAX takes no more.
+ */
+int dir_add_entry(image_t *img, uint64_t dir_ino, const char name[58], uint32_t child, uint8_t type) {
+    inode_t *dir = inode_at(img, dir_ino);
+    if (dir->links == UINT16_MAX) {
+        fprintf(stderr, "Too many entries in directory (max %u)\n", UINT16_MAX - 2u);
+        return -1;
+    }
+    dirent64_t entry = { .inode_no = child, .type = type };
+    memcpy(entry.name, name, sizeof(entry.name));
+    dirent_checksum_finalize(&entry);
+
+    dirent64_t *slot = NULL;
+    if (!dir_is_hashed(dir)) {
+        uint64_t n = dir_slot_count(dir);
+        for (uint64_t i = 0; i < n && i < DIRENTS_PER_BLOCK && !slot; i++) {
+            dirent64_t *de = dir_slot(img->base, &img->sb, dir, i);
+            if (de && de->inode_no == 0) slot = de;
+        }
+        if (!slot && n < DIRENTS_PER_BLOCK) {
+            slot = dir_slot(img->base, &img->sb, dir, n);
+            dir->size_bytes += sizeof(dirent64_t);
+        }
+    } else {
+        slot = dir_free_slot(img, dir, name);
+    }
+    while (!slot) {
+        uint64_t nbuckets = dir_is_hashed(dir) ? dir->size_bytes / BS * 2 : DIR_HASH_MIN_BUCKETS;
+        if (dir_rehash(img, dir_ino, dir, nbuckets) != 0) return -1;
+        slot = dir_free_slot(img, dir, name);
+    }
+    dir_store(img, slot, &entry);
+    inode_crc_finalize(dir, img->sb.flags);
+    mark_inode_dirty(img, dir_ino);
+    return 0;
+}
+
+static size_t dcache_slot(const dcache_t *dc, uint32_t parent, const char name[58]) {
+    return (dirent_name_hash(name) ^ parent * 0x9E3779B1u) & (dc->cap - 1);
+}
+
+uint32_t dcache_get(const dcache_t *dc, uint32_t parent, const char name[58]) {
+    if (dc->cap == 0) return 0;
+    for (size_t i = dcache_slot(dc, parent, name); dc->slots[i].ino; i = (i + 1) & (dc->cap - 1)) {
+        if (dc->slots[i].parent == parent && memcmp(dc->slots[i].name, name, 58) == 0) return dc->slots[i].ino;
+    }
+    return 0;
+}
+
+// Caches a resolved directory; on allocation failure the entry is just not cached.
+void dcache_put(dcache_t *dc, uint32_t parent, const char name[58], uint32_t ino) {
+    if ((dc->count + 1) * 4 > dc->cap * 3) {
+        size_t cap = dc->cap ? dc->cap * 2 : 64;
+        dcache_entry_t *slots = calloc(cap, sizeof(*slots));
+        if (!slots) return;
+        dcache_t grown = { slots, cap, dc->count };
+        for (size_t i = 0; i < dc->cap; i++) {
+            if (!dc->slots[i].ino) continue;
+            size_t j = dcache_slot(&grown, dc->slots[i].parent, dc->slots[i].name);
+            while (slots[j].ino) j = (j + 1) & (cap - 1);
+            slots[j] = dc->slots[i];
+        }
+        free(dc->slots);
+        *dc = grown;
+    }
+    size_t i = dcache_slot(dc, parent, name);
+    while (dc->slots[i].ino) i = (i + 1) & (dc->cap - 1);
+    dc->slots[i].parent = parent;
+    dc->slots[i].ino = ino;
+    memcpy(dc->slots[i].name, name, 58);
+    dc->count++;
+}
+
+// A free inode number, preferring group 'home', or -1 after reporting that there is none.
+int64_t find_free_inode(image_t *img, uint64_t home) {
+    const uint64_t count = img->groups.count;
+    for (uint64_t i = 0; i < count && image_free_inodes(img); i++) {
+        uint64_t g = (home + i) % count;
+        int64_t idx = bitmap_find_free(&img->inodes[g]);
+        if (idx >= 0) return g * img->groups.inodes_per_group + idx + 1;
+    }
+    fprintf(stderr, "Sorry.No free inodes available\n");
+    return -1;
+}
+
+void claim_inode(image_t *img, uint64_t ino) {
+    bitmap_t *bm = &img->inodes[inode_group(img, ino)];
+    uint64_t idx = (ino - 1) % img->groups.inodes_per_group;
+    bitmap_set(bm, idx);
+    bm->cursor = idx + 1;
+    mark_inode_bit_dirty(img, ino - 1);
+}
+
+void unclaim_inode(image_t *img, uint64_t ino) {
+    bitmap_t *bm = &img->inodes[inode_group(img, ino)];
+    uint64_t idx = (ino - 1) % img->groups.inodes_per_group;
+    bitmap_clear(bm, idx);
+    bm->cursor = idx;
+    if (ino - 1 < img->counters.inode_hint) img->counters.inode_hint = ino - 1;
+}
+
+// Takes a free inode, preferring group 'home'; the caller fills it in.
+int64_t alloc_inode(image_t *img, uint64_t home) {
+    int64_t ino = find_free_inode(img, home);
+    if (ino > 0) claim_inode(img, ino);
+    return ino;
+}
+
+// Counts a new entry of dir: every child refers back to it through "..".
+void dir_link_child(image_t *img, uint64_t dir_ino) {
+    inode_t *dir = inode_at(img, dir_ino);
+    dir->links++;
+    inode_crc_finalize(dir, img->sb.flags);
+    mark_inode_dirty(img, dir_ino);
+}
+
+/*
+ * Creates directory 'name' in parent, with "." and ".." in its first block.
+ * New directories go round-robin over the allocation groups, so separate
+ * subtrees (and the files added into them) end up in separate groups.
+ */
+int64_t make_dir(image_t *img, uint32_t parent, const char name[58], time_t now) {
+    uint64_t blk, fragments;
+    int64_t ino = alloc_inode(img, img->next_dir_group++ % img->groups.count);
+    if (ino < 0) return -1;
+    if (image_alloc_blocks(img, inode_group(img, ino), 1, &blk, &fragments) != 1) {
+        fprintf(stderr, "Not enough free data blocks\n");
+        unclaim_inode(img, ino);
+        return -1;
+    }
+    if (dir_add_entry(img, parent, name, ino, DIRENT_DIR) != 0) {
+        release_blocks(img, &blk, 1);
+        unclaim_inode(img, ino);
+        return -1;
+    }
+    mark_data_bit_dirty(img, blk);
+
+    uint32_t block = img->sb.data_region_start + blk;
+    dirent64_t *entries = (dirent64_t *)image_block(img, block);
+    memset(entries, 0, BS);
+    entries[0].inode_no = ino;
+    entries[0].type = DIRENT_DIR;
+    dirent_name(entries[0].name, ".");
+    dirent_checksum_finalize(&entries[0]);
+    entries[1].inode_no = parent;
+    entries[1].type = DIRENT_DIR;
+    dirent_name(entries[1].name, "..");
+    dirent_checksum_finalize(&entries[1]);
+    mark_dirty(img, block);
+
+    inode_t *dir = inode_at(img, ino);
+    memset(dir, 0, sizeof(*dir));
+    dir->mode = MODE_DIR;
+    dir->links = 2;
+    dir->size_bytes = 2 * sizeof(dirent64_t);
+    dir->atime = now;
+    dir->mtime = now;
+    dir->ctime = now;
+    dir->direct[0] = block;
+    dir->proj_id = 1234;
+    inode_crc_finalize(dir, img->sb.flags);
+    mark_inode_dirty(img, ino);
+
+    dir_link_child(img, parent);
+    return ino;
+}
+
+/*
+ * Resolves the directory part of path (everything before the last '/'),
+ * creating missing directories like mkdir -p, and stores the final component
+ * in leaf. Resolved directories go into the dentry cache, so a batch only
+ * looks each one up on disk once. Returns the directory's inode number, or -1
+ * for an invalid path, including a component longer than a dirent name.
+ */
+int64_t resolve_parent(image_t *img, const char *path, char leaf[58], time_t now) {
+    uint32_t dir = ROOT_INO;
+    const char *p = path;
+    for (;;) {
+        while (*p == '/') p++;
+        size_t len = strcspn(p, "/");
+        const char *next = p + len;
+        while (*next == '/') next++;
+        char comp[58] = {0};
+        memcpy(comp, p, len < 57 ? len : 57);
+        if (len == 0 || strcmp(comp, ".") == 0 || strcmp(comp, "..") == 0) {
+            fprintf(stderr, "Invalid target path '%s'\n", path);
+            return -1;
+        }
+        if (len > 57) {
+            fprintf(stderr, "Name too long (max 57 bytes): %s\n", path);
+            return -1;
+        }
+        if (*next == '\0') {
+            memcpy(leaf, comp, 58);
+            return dir;
+        }
+
+        uint32_t child = dcache_get(&img->dcache, dir, comp);
+        if (!child) {
+            const dirent64_t *de = dir_lookup(img->base, &img->sb, inode_at(img, dir), comp);
+            if (de && (de->type != DIRENT_DIR || de->inode_no < ROOT_INO || de->inode_no > img->sb.inode_count ||
+                       !(inode_at(img, de->inode_no)->mode & MODE_DIR))) {
+                fprintf(stderr, "'%s' in path '%s' is not a directory\n", comp, path);
+                return -1;
+            }
+            if (de) {
+                child = de->inode_no;
+            } else {
+                int64_t made = make_dir(img, dir, comp, now);
+                if (made < 0) return -1;
+                child = made;
+            }
+            dcache_put(&img->dcache, dir, comp, child);
+        }
+        dir = child;
+        p = next;
+    }
+}
+
+/*
+ * Dedup decisions for one file, made before its blocks are allocated:
+ * block k either gets a new block, reuses an image block with the same
+ * content (data_blocks[k] set), or repeats earlier block same_as[k] of the
+ * same file. skip[k] marks the last two kinds, which are never written.
+ */
+typedef struct {
+    uint64_t *same_as;
+    uint32_t *hashes;
+    uint8_t *skip;
+    uint64_t shared;
+} dedup_plan_t;
+
+#define DEDUP_READ_BLOCKS 64u
+
+void dedup_plan_free(dedup_plan_t *plan) {
+    free(plan->same_as);
+    free(plan->hashes);
+    free(plan->skip);
+}
+
+// Reads len bytes at off; returns how many were read before EOF, or -1.
+int64_t read_full(int fd, uint8_t *buf, uint64_t len, uint64_t off) {
+    uint64_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+// Block k of a host file as stored in the image, zero-padded past the end of the file.
+int read_host_block(int fd, uint64_t size, uint64_t k, uint8_t *buf) {
+    uint64_t len = size - k * BS < BS ? size - k * BS : BS;
+    if (read_full(fd, buf, len, k * BS) != (int64_t)len) return -1;
+    memset(buf + len, 0, BS - len);
+    return 0;
+}
+
+/*
+ * Hashes every block of the host file and looks it up, first among the
+ * blocks the dedup index knows (still allocated and byte-identical, checked
+ * against the image itself), then among the file's own earlier blocks.
+ */
+int dedup_plan_file(image_t *img, int src_fd, uint64_t size, uint64_t nblocks, uint32_t *data_blocks,
+                    dedup_plan_t *plan) {
+    uint64_t n = nblocks ? nblocks : 1;
+    *plan = (dedup_plan_t){ malloc(n * sizeof(uint64_t)), malloc(n * sizeof(uint32_t)), calloc(n, 1), 0 };
+    uint8_t *buf = malloc(DEDUP_READ_BLOCKS * BS), *cmp = malloc(BS);
+    dedup_index_t local = {0};  // new blocks of this file, stored as block = k + 1
+    int rc = 0;
+    if (!plan->same_as || !plan->hashes || !plan->skip || !buf || !cmp) {
+        perror("Failed to allocate dedup buffers");
+        rc = -1;
+    }
+    for (uint64_t k0 = 0; k0 < nblocks && rc == 0; k0 += DEDUP_READ_BLOCKS) {
+        uint64_t count = nblocks - k0 < DEDUP_READ_BLOCKS ? nblocks - k0 : DEDUP_READ_BLOCKS;
+        uint64_t want = size - k0 * BS < count * BS ? size - k0 * BS : count * BS;
+        if (read_full(src_fd, buf, want, k0 * BS) != (int64_t)want) {
+            fprintf(stderr, "Failed to read file content\n");
+            rc = -1;
+            break;
+        }
+        memset(buf + want, 0, count * BS - want);
+        for (uint64_t j = 0; j < count; j++) {
+            uint64_t k = k0 + j;
+            const uint8_t *blk = buf + j * BS;
+            uint32_t h = crc32(blk, BS);
+            plan->hashes[k] = h;
+            plan->same_as[k] = k;
+
+            uint64_t pos = UINT64_MAX;
+            dedup_entry_t *e;
+            while ((e = dedup_next(&img->index, h, &pos)) != NULL) {
+                if (block_in_data_region(img->base, &img->sb, e->block) &&
+                    data_block_used(img, e->block - img->sb.data_region_start) &&
+                    read_full(img->fd, cmp, BS, (uint64_t)e->block * BS) == BS && memcmp(cmp, blk, BS) == 0) {
+                    data_blocks[k] = e->block;
+                    plan->skip[k] = 1;
+                    break;
+                }
+            }
+            pos = UINT64_MAX;
+            while (!plan->skip[k] && (e = dedup_next(&local, h, &pos)) != NULL) {
+                uint64_t prev = e->block - 1;
+                const uint8_t *other = cmp;
+                if (prev >= k0) other = buf + (prev - k0) * BS;
+                else if (read_host_block(src_fd, size, prev, cmp) != 0) continue;
+                if (memcmp(other, blk, BS) == 0) {
+                    plan->same_as[k] = prev;
+                    plan->skip[k] = 1;
+                }
+            }
+            if (plan->skip[k]) plan->shared++;
+            else dedup_insert(&local, h, k + 1, 0);     // if this fails, later copies are just not shared
+        }
+    }
+    dedup_free(&local);
+    free(buf);
+    free(cmp);
+    if (rc != 0) dedup_plan_free(plan);
+    return rc;
+}
+
+// Once the file is in: index its new blocks and count the extra references to shared ones.
+void dedup_record(image_t *img, const dedup_plan_t *plan, const uint32_t *data_blocks, uint64_t nblocks) {
+    for (uint64_t k = 0; k < nblocks; k++) {
+        uint32_t h = plan->hashes[k];
+        if (!plan->skip[k]) {
+            if (!dedup_insert(&img->index, h, data_blocks[k], 1))
+                fprintf(stderr, "Warning: dedup index is out of memory; block %" PRIu32 " is not indexed\n",
+                        data_blocks[k]);
+            continue;
+        }
+        uint64_t pos = UINT64_MAX;
+        dedup_entry_t *e;
+        while ((e = dedup_next(&img->index, h, &pos)) != NULL) {
+            if (e->block == data_blocks[k]) {
+                e->refs++;
+                break;
+            }
+        }
+    }
+    img->blocks_saved += plan->shared;
+}
+
+/*
+ * Compression decision for one file (--compress): the stored length of every
+ * MVZ_GROUP_SIZE group, found by compressing the file once and throwing the
+ * output away. The groups are compressed again while they are written; the
+ * codec is deterministic, so that pass must reproduce these lengths.
+ */
+typedef struct {
+    uint32_t *lengths;
+    uint64_t ngroups;
+    uint64_t nblocks;   // blocks the compressed stream occupies
+} compress_plan_t;
+
+#define COMPRESS_STAGE_BLOCKS 32u
+
+void compress_plan_free(compress_plan_t *plan) {
+    free(plan->lengths);
+    *plan = (compress_plan_t){0};
+}
+
+// Compresses group g of the host file into out; returns its length word (| MVZ_STORED if kept raw), or 0.
+uint32_t compress_group(int src_fd, uint64_t size, uint64_t g, uint8_t *in, uint8_t *out, const uint8_t **payload) {
+    uint64_t off = g * MVZ_GROUP_SIZE;
+    uint64_t len = size - off < MVZ_GROUP_SIZE ? size - off : MVZ_GROUP_SIZE;
+    if (read_full(src_fd, in, len, off) != (int64_t)len) return 0;
+    uint64_t clen = lz_compress(in, len, out, len - 1);
+    if (clen == 0) {
+        *payload = in;
+        return (uint32_t)len | MVZ_STORED;
+    }
+    *payload = out;
+    return (uint32_t)clen;
+}
+
+int compress_plan_file(int src_fd, uint64_t size, compress_plan_t *plan) {
+    *plan = (compress_plan_t){0};
+    uint64_t ngroups = mvz_group_count(size);
+    uint32_t *lengths = malloc((ngroups ? ngroups : 1) * sizeof(*lengths));
+    uint8_t *in = malloc(MVZ_GROUP_SIZE), *out = malloc(MVZ_GROUP_SIZE);
+    int rc = 0;
+    if (!lengths || !in || !out) {
+        perror("Failed to allocate compression buffers");
+        rc = -1;
+    }
+    for (uint64_t g = 0; g < ngroups && rc == 0; g++) {
+        const uint8_t *payload;
+        lengths[g] = compress_group(src_fd, size, g, in, out, &payload);
+        if (lengths[g] == 0) {
+            fprintf(stderr, "Failed to read file content\n");
+            rc = -1;
+        }
+    }
+    free(in);
+    free(out);
+    if (rc != 0) {
+        free(lengths);
+        return -1;
+    }
+    *plan = (compress_plan_t){ lengths, ngroups, (mvz_stored_bytes(lengths, ngroups) + BS - 1) / BS };
+    return 0;
+}
+
+/*
+ * Buffers the compressed stream and writes it out COMPRESS_STAGE_BLOCKS at a
+ * time, one pwrite() per contiguous run of the file's blocks.
+ */
+typedef struct {
+    image_t *img;
+    const uint32_t *blocks;
+    uint64_t next;      // file block the buffer starts at
+    uint8_t *buf;
+    uint64_t fill;
+} stage_t;
+
+int stage_flush(stage_t *st) {
+    uint64_t nblocks = (st->fill + BS - 1) / BS;
+    memset(st->buf + st->fill, 0, nblocks * BS - st->fill);
+    for (uint64_t k = 0; k < nblocks; ) {
+        uint64_t run = 1;
+        while (k + run < nblocks && st->blocks[st->next + k + run] == st->blocks[st->next + k] + run) run++;
+        uint64_t len = run * BS;
+        if (pwrite(st->img->fd, st->buf + k * BS, len, (off_t)st->blocks[st->next + k] * BS) != (ssize_t)len) {
+            perror("Failed to write compressed data");
+            return -1;
+        }
+        k += run;
+    }
+    st->next += nblocks;
+    st->fill = 0;
+    return 0;
+}
+
+int stage_put(stage_t *st, const uint8_t *data, uint64_t len) {
+    while (len > 0) {
+        uint64_t n = COMPRESS_STAGE_BLOCKS * BS - st->fill;
+        if (n > len) n = len;
+        memcpy(st->buf + st->fill, data, n);
+        st->fill += n;
+        data += n;
+        len -= n;
+        if (st->fill == COMPRESS_STAGE_BLOCKS * BS && stage_flush(st) != 0) return -1;
+    }
+    return 0;
+}
+
+// Writes the header, length table and group payloads of a planned file to its blocks.
+int write_compressed(image_t *img, int src_fd, uint64_t size, const compress_plan_t *plan, const uint32_t *blocks) {
+    stage_t st = { img, blocks, 0, malloc(COMPRESS_STAGE_BLOCKS * BS), 0 };
+    uint8_t *in = malloc(MVZ_GROUP_SIZE), *out = malloc(MVZ_GROUP_SIZE);
+    int rc = 0;
+    if (!st.buf || !in || !out) {
+        perror("Failed to allocate compression buffers");
+        rc = -1;
+    }
+    mvz_header_t hdr = { MVZ_MAGIC, MVZ_GROUP_SIZE, (uint32_t)plan->ngroups, 0 };
+    if (rc == 0) rc = stage_put(&st, (const uint8_t *)&hdr, sizeof(hdr));
+    if (rc == 0) rc = stage_put(&st, (const uint8_t *)plan->lengths, plan->ngroups * sizeof(uint32_t));
+    for (uint64_t g = 0; g < plan->ngroups && rc == 0; g++) {
+        const uint8_t *payload = NULL;
+        uint32_t word = compress_group(src_fd, size, g, in, out, &payload);
+        if (word != plan->lengths[g]) {
+            fprintf(stderr, "File changed while it was being added\n");
+            rc = -1;
+            break;
+        }
+        rc = stage_put(&st, payload, word & ~MVZ_STORED);
+    }
+    if (rc == 0 && st.fill > 0) rc = stage_flush(&st);
+    free(st.buf);
+    free(in);
+    free(out);
+    return rc;
+}
+
+// Checksums the blocks of a file just written through the fd (skipping skip[k]), reading them back in runs.
+int csum_file_blocks(image_t *img, const uint32_t *blocks, const uint8_t *skip, uint64_t nblocks) {
+    if (!(img->sb.flags & MVSFS_FEAT_DATACSUM) || nblocks == 0) return 0;
+    uint8_t *buf = malloc(CSUM_READ_BLOCKS * BS);
+    if (!buf) {
+        perror("Failed to allocate checksum buffer");
+        return -1;
+    }
+    int rc = 0;
+    for (uint64_t k = 0; k < nblocks && rc == 0; ) {
+        if (skip && skip[k]) {
+            k++;
+            continue;
+        }
+        uint64_t run = 1;
+        while (k + run < nblocks && run < CSUM_READ_BLOCKS && blocks[k + run] == blocks[k] + run &&
+               !(skip && skip[k + run])) run++;
+        if (read_full(img->fd, buf, run * BS, (uint64_t)blocks[k] * BS) != (int64_t)(run * BS)) {
+            fprintf(stderr, "Failed to read back file content\n");
+            rc = -1;
+            break;
+        }
+        for (uint64_t j = 0; j < run; j++) csum_update(img, blocks[k] + j, buf + j * BS);
+        k += run;
+    }
+    free(buf);
+    return rc;
+}
+
+// Adds one file; directories created on the way are kept even if the file then fails.
+int add_file(image_t *img, const add_spec_t *spec, time_t now) {
+    superblock_t *sb = &img->sb;
+
+    char name[58];
+    int64_t parent = resolve_parent(img, spec->name, name, now);
+    if (parent < 0) return -1;
+    if (dir_lookup(img->base, sb, inode_at(img, parent), name)) {
+        fprintf(stderr, "File '%s' already exists\n", spec->name);
+        return -1;
+    }
+
+    // The file goes into its directory's group, data next to the inode.
+    int64_t found = find_free_inode(img, inode_group(img, parent));
+    if (found < 0) return -1;
+    uint32_t free_inode = found;
+
+    int src_fd = open(spec->host_path, O_RDONLY);
+    struct stat st;
+    if (src_fd < 0 || fstat(src_fd, &st) != 0) {
+        fprintf(stderr, "Failed to open file to add '%s': %s\n", spec->host_path, strerror(errno));
+        if (src_fd >= 0) close(src_fd);
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Not a regular file: %s\n", spec->host_path);
+        close(src_fd);
+        return -1;
+    }
+    uint64_t file_size = st.st_size;
+
+    uint64_t needed_blocks = (file_size + BS - 1) / BS;
+    if (needed_blocks > MAX_FILE_BLOCKS) {
+        fprintf(stderr, "File too large - exceeds %" PRIu64 " blocks: %s\n",
+                (uint64_t)MAX_FILE_BLOCKS, spec->host_path);
+        close(src_fd);
+        return -1;
+    }
+
+    // Keep the compressed form only if it needs fewer blocks, indirect blocks included.
+    compress_plan_t cplan = {0};
+    if (img->compress && needed_blocks > 0) {
+        if (compress_plan_file(src_fd, file_size, &cplan) != 0) {
+            close(src_fd);
+            return -1;
+        }
+        if (cplan.nblocks + indirect_blocks_for(cplan.nblocks) >= needed_blocks + indirect_blocks_for(needed_blocks))
+            compress_plan_free(&cplan);
+    }
+    int compressed = cplan.lengths != NULL;
+    uint64_t stored_blocks = compressed ? cplan.nblocks : needed_blocks;
+
+    uint32_t *data_blocks = calloc(stored_blocks ? stored_blocks : 1, sizeof(*data_blocks));
+    dedup_plan_t plan = {0};
+    if (!data_blocks) {
+        perror("Failed to allocate block list");
+        compress_plan_free(&cplan);
+        close(src_fd);
+        return -1;
+    }
+    // A compressed stream has no block-aligned content to share, so dedup only sees plain files.
+    if (img->dedup && !compressed &&
+        dedup_plan_file(img, src_fd, file_size, needed_blocks, data_blocks, &plan) != 0) {
+        free(data_blocks);
+        close(src_fd);
+        return -1;
+    }
+
+    // Allocate data and indirect blocks together; they are released again if the file cannot be copied.
+    uint64_t total_blocks = stored_blocks - plan.shared + indirect_blocks_for(stored_blocks);
+    uint64_t *block_idx = calloc(total_blocks ? total_blocks : 1, sizeof(*block_idx));
+    if (!block_idx) {
+        perror("Failed to allocate block list");
+        compress_plan_free(&cplan);
+        dedup_plan_free(&plan);
+        free(data_blocks);
+        close(src_fd);
+        return -1;
+    }
+    uint64_t fragments = 0;
+    uint64_t got = image_alloc_blocks(img, inode_group(img, free_inode), total_blocks, block_idx, &fragments);
+    if (got != total_blocks) {
+        fprintf(stderr, "Not enough free data blocks\n");
+        release_blocks(img, block_idx, got);
+        free(block_idx);
+        compress_plan_free(&cplan);
+        dedup_plan_free(&plan);
+        free(data_blocks);
+        close(src_fd);
+        return -1;
+    }
+
+    inode_t new_ino = {0};
+    map_file_blocks(img, &new_ino, block_idx, stored_blocks, data_blocks, plan.same_as);
+
+    // Stream file content to its data blocks
+    int rc = compressed ? write_compressed(img, src_fd, file_size, &cplan, data_blocks)
+                        : stream_file(img, src_fd, data_blocks, plan.skip, needed_blocks, file_size);
+    compress_plan_free(&cplan);
+    close(src_fd);
+    if (rc == 0) rc = csum_file_blocks(img, data_blocks, compressed ? NULL : plan.skip, stored_blocks);
+    if (rc != 0) {
+        release_blocks(img, block_idx, total_blocks);
+        free(block_idx);
+        dedup_plan_free(&plan);
+        free(data_blocks);
+        return -1;
+    }
+
+    // Create directory entry
+    if (dir_add_entry(img, parent, name, free_inode, DIRENT_FILE) != 0) {
+        release_blocks(img, block_idx, total_blocks);
+        free(block_idx);
+        dedup_plan_free(&plan);
+        free(data_blocks);
+        return -1;
+    }
+    for (uint64_t k = 0; k < total_blocks; k++) mark_data_bit_dirty(img, block_idx[k]);
+    free(block_idx);
+    if (stored_blocks > N_DIRECT) enable_feature(img, MVSFS_FEAT_INDIRECT);
+    if (img->dedup && !compressed) {
+        dedup_record(img, &plan, data_blocks, needed_blocks);
+        if (plan.shared) enable_feature(img, MVSFS_FEAT_SHARED);
+    }
+    if (compressed) {
+        new_ino.reserved_0 |= INODE_F_COMPRESSED;
+        enable_feature(img, MVSFS_FEAT_COMPRESS);
+        img->files_compressed++;
+        img->blocks_compressed_away += needed_blocks - stored_blocks;
+    }
+    dedup_plan_free(&plan);
+    free(data_blocks);
+
+    // Create new inode
+    inode_t *new_inode = inode_at(img, free_inode);
+    *new_inode = new_ino;
+    new_inode->mode = MODE_FILE;
+    new_inode->links = 1;
+    new_inode->uid = 0;
+    new_inode->gid = 0;
+    new_inode->size_bytes = file_size;
+    new_inode->atime = now;
+    new_inode->mtime = now;
+    new_inode->ctime = now;
+    new_inode->proj_id = 1234;
+    inode_crc_finalize(new_inode, img->sb.flags);
+
+    claim_inode(img, free_inode);
+    mark_inode_dirty(img, free_inode);
+
+    dir_link_child(img, parent);
+
+    printf("File '%s' added successfully to inode %" PRIu32 " (%" PRIu64 " block(s), %" PRIu64 " fragment(s)",
+           spec->name, free_inode, stored_blocks, fragments);
+    if (img->dedup) printf(", %" PRIu64 " shared", plan.shared);
+    if (compressed) printf(", compressed from %" PRIu64, needed_blocks);
+    printf(")\n");
+    return free_inode;
+}
+
+int main(int argc, char *argv[]) {
+    char *input_name = NULL;
+    char *output_name = NULL;
+    int in_place = 0;
+    extent_policy_t policy = EXTENT_FIRST_FIT;
+    int dedup = 0;
+    int compress = 0;
+    add_list_t files = {0};
+
+    static struct option long_options[] = {
+        {"input", required_argument, 0, 'i'},
+        {"output", required_argument, 0, 'o'},
+        {"file", required_argument, 0, 'f'},
+        {"dest", required_argument, 0, 'd'},
+        {"manifest", required_argument, 0, 'm'},
+        {"in-place", no_argument, 0, 'p'},
+        {"alloc-policy", required_argument, 0, 'a'},
+        {"dedup", no_argument, 0, 'D'},
+        {"compress", no_argument, 0, 'z'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "i:o:f:d:m:pa:Dz", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'i': input_name = optarg; break;
+            case 'o': output_name = optarg; break;
+            case 'p': in_place = 1; break;
+            case 'D': dedup = 1; break;
+            case 'z': compress = 1; break;
+            case 'a':
+                if (strcmp(optarg, "first-fit") == 0) {
+                    policy = EXTENT_FIRST_FIT;
+                } else if (strcmp(optarg, "best-fit") == 0) {
+                    policy = EXTENT_BEST_FIT;
+                } else {
+                    usage();
+                    add_list_free(&files);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f':
+                if (add_list_push(&files, optarg, host_basename(optarg)) != 0) {
+                    add_list_free(&files);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'd':
+                if (add_list_set_dest(&files, optarg) != 0) {
+                    add_list_free(&files);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                if (read_manifest(optarg, &files) != 0) {
+                    add_list_free(&files);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage();
+                add_list_free(&files);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (!input_name || (!output_name && !in_place) || files.count == 0) {
+        usage();
+        add_list_free(&files);
+        exit(EXIT_FAILURE);
+    }
+
+    // Writing to the input image itself is the same as --in-place.
+    struct stat st_in, st_out;
+    if (output_name && stat(input_name, &st_in) == 0 && stat(output_name, &st_out) == 0 &&
+        st_in.st_dev == st_out.st_dev && st_in.st_ino == st_out.st_ino) {
+        in_place = 1;
+    }
+    if (in_place) output_name = input_name;
+
+    if (!in_place && image_copy(input_name, output_name) != 0) {
+        add_list_free(&files);
+        exit(EXIT_FAILURE);
+    }
+
+    image_t img;
+    if (image_open(&img, output_name, in_place, policy) != 0) {
+        if (!in_place) unlink(output_name);
+        add_list_free(&files);
+        exit(EXIT_FAILURE);
+    }
+
+    // The dedup index follows the image: read from <input>.dedup, written to <output>.dedup.
+    char index_in[PATH_MAX], index_out[PATH_MAX];
+    snprintf(index_in, sizeof(index_in), "%s.dedup", input_name);
+    snprintf(index_out, sizeof(index_out), "%s.dedup", output_name);
+    img.dedup = dedup;
+    img.compress = compress;
+    if (dedup && dedup_load(&img.index, index_in, img.sb.total_blocks) != 0) {
+        image_close(&img);
+        if (!in_place) unlink(output_name);
+        add_list_free(&files);
+        exit(EXIT_FAILURE);
+    }
+
+    // Ingest every file into the image, then commit it once.
+    time_t now = time(NULL);
+    for (size_t i = 0; i < files.count; i++) {
+        if (add_file(&img, &files.items[i], now) == -1) {
+            if (img.in_place && img.mapped) {
+                // Each add is all-or-nothing, but the earlier ones (and any directories
+                // created on the way) already live in the image.
+                image_sync_csums(&img);
+                image_sync_counters(&img);
+                if (i > 0) {
+                    fprintf(stderr, "%zu file(s) were added before the failure\n", i);
+                    if (dedup) dedup_save(&img.index, index_out, img.sb.total_blocks);
+                }
+            }
+            image_close(&img);
+            if (!in_place) unlink(output_name);
+            add_list_free(&files);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("Added %zu file(s)\n", files.count);
+    if (dedup) {
+        printf("Deduplicated %" PRIu64 " block(s), saved %" PRIu64 " bytes\n",
+               img.blocks_saved, img.blocks_saved * BS);
+    }
+    if (compress) {
+        printf("Compressed %" PRIu64 " file(s), saved %" PRIu64 " block(s)\n",
+               img.files_compressed, img.blocks_compressed_away);
+    }
+    printf("Free: %" PRIu64 " of %" PRIu64 " inode(s), %" PRIu64 " of %" PRIu64 " data block(s)\n",
+           image_free_inodes(&img), img.sb.inode_count, image_free_blocks(&img), img.sb.data_region_blocks);
+    image_sync_csums(&img);
+    image_sync_counters(&img);
+    int rc = image_commit(&img, output_name);
+    if (rc == 0 && dedup) rc = dedup_save(&img.index, index_out, img.sb.total_blocks);
+    image_close(&img);
+    if (rc != 0 && !in_place) unlink(output_name);
+    add_list_free(&files);
+
+    return rc == 0 ? 0 : EXIT_FAILURE;
+}
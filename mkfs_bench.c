@@ -0,0 +1,393 @@
+/*
+ * Microbenchmarks for the MiniVSFS tool internals.
+ *
+ *   cc -O2 -o mkfs_bench mkfs_bench.c
+ *   ./mkfs_bench alloc summary dirent csum
+ *
+ * Each benchmark compares the current implementation with the one it
+ * replaced, on the same inputs, and prints the time per operation.
+ */
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "bitmap_alloc.h"
+#include "dirent_csum.h"
+#include "crc32.h"
+
+#define BS 4096u
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Keeps results live so the compiler cannot drop the measured work.
+static volatile uint64_t sink;
+
+
+/* ---- alloc: bitmap allocator vs. the original bit-at-a-time scan ---- */
+
+// The allocator mkfs_adder used before bitmap_alloc.h, kept verbatim for comparison.
+static int legacy_find_free_data_block(uint8_t *bitmap, uint64_t data_blocks) {
+    for (uint64_t initial = 0; initial < data_blocks; initial++) {
+        if (!(bitmap[initial / 8] & (1 << (initial % 8)))) {
+            return initial;
+        }
+    }
+    return -1;
+}
+
+// Fills nbits of bitmap so that 'occupancy' of them are used, uniformly at random.
+static void fill_bitmap(uint8_t *bits, uint64_t nbits, double occupancy) {
+    memset(bits, 0, (nbits + 7) / 8);
+    for (uint64_t i = 0; i < nbits; i++)
+        if ((double)(rng() % 1000000) < occupancy * 1000000.0) bits[i / 8] |= (uint8_t)(1u << (i % 8));
+}
+
+static void bench_alloc(void) {
+    const uint64_t nbits = BS * 8;          // one full bitmap block
+    const uint64_t per_file = 12;           // blocks per allocation, the direct[] limit
+    const double occupancies[] = {0.90, 0.99, 0.999};
+    uint8_t *pristine = malloc(BS), *work = malloc(BS);
+    if (!pristine || !work) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("alloc: %" PRIu64 "-bit bitmap, %" PRIu64 " blocks per file, allocate until full\n",
+           nbits, per_file);
+    printf("%-10s %12s %14s %14s %9s\n", "occupancy", "free blocks", "legacy ns/blk", "bitmap ns/blk", "speedup");
+    for (size_t o = 0; o < sizeof(occupancies) / sizeof(occupancies[0]); o++) {
+        fill_bitmap(pristine, nbits, occupancies[o]);
+        uint64_t free_blocks = 0;
+        for (uint64_t i = 0; i < nbits; i++) free_blocks += !(pristine[i / 8] & (1u << (i % 8)));
+        if (free_blocks == 0) continue;
+
+        int reps = 1;
+        double t_legacy, t_new;
+        for (;;) {
+            double t0 = now_sec();
+            for (int r = 0; r < reps; r++) {
+                memcpy(work, pristine, BS);
+                // As the old main() did: every block restarts the scan from bit 0.
+                for (;;) {
+                    int b = legacy_find_free_data_block(work, nbits);
+                    if (b < 0) break;
+                    work[b / 8] |= (uint8_t)(1u << (b % 8));
+                    sink += b;
+                }
+            }
+            t_legacy = now_sec() - t0;
+            if (t_legacy > 0.2 || reps >= (1 << 20)) break;
+            reps *= 2;
+        }
+
+        int reps_new = reps;
+        for (;;) {
+            double t0 = now_sec();
+            for (int r = 0; r < reps_new; r++) {
+                memcpy(work, pristine, BS);
+                bitmap_t bm;
+                bitmap_init(&bm, work, nbits);
+                uint64_t idx[12], got;
+                while ((got = bitmap_alloc(&bm, per_file, idx)) > 0) sink += idx[got - 1];
+            }
+            t_new = now_sec() - t0;
+            if (t_new > 0.2 || reps_new >= (1 << 24)) break;
+            reps_new *= 2;
+        }
+
+        double ns_legacy = t_legacy * 1e9 / ((double)reps * free_blocks);
+        double ns_new = t_new * 1e9 / ((double)reps_new * free_blocks);
+        printf("%-10.3f %12" PRIu64 " %14.1f %14.1f %8.1fx\n",
+               occupancies[o], free_blocks, ns_legacy, ns_new, ns_legacy / ns_new);
+    }
+    free(pristine);
+    free(work);
+}
+
+
+/* ---- summary: free search with and without the hierarchical summary ---- */
+
+#define SUMMARY_BITS (1ull << 24)       // a 2 MiB bitmap, e.g. a 64 GiB data region
+#define SUMMARY_LOOKUPS 100000
+#define SUMMARY_FIRST_FIT 2000
+
+/*
+ * Two workloads per occupancy: first-free lookups from random positions,
+ * and first-fit allocation that restarts every search at bit 0 (what the
+ * original find_free_* helpers did), timed over SUMMARY_FIRST_FIT blocks.
+ */
+static void summary_run(bitmap_t *bm, const uint64_t *starts,
+                        double *ns_lookup, double *ns_first_fit) {
+    double t0 = now_sec();
+    for (int i = 0; i < SUMMARY_LOOKUPS; i++) sink += (uint64_t)bitmap_scan(bm, starts[i], bm->nbits);
+    *ns_lookup = (now_sec() - t0) * 1e9 / SUMMARY_LOOKUPS;
+
+    t0 = now_sec();
+    int n = 0;
+    for (; n < SUMMARY_FIRST_FIT; n++) {
+        int64_t b = bitmap_scan(bm, 0, bm->nbits);
+        if (b < 0) break;
+        bitmap_set(bm, (uint64_t)b);
+        sink += (uint64_t)b;
+    }
+    *ns_first_fit = n ? (now_sec() - t0) * 1e9 / n : 0;
+}
+
+static void bench_summary(void) {
+    const double occupancies[] = {0.90, 0.99, 0.999};
+    uint8_t *pristine = malloc(SUMMARY_BITS / 8), *work = malloc(SUMMARY_BITS / 8);
+    uint64_t *starts = malloc(SUMMARY_LOOKUPS * sizeof(*starts));
+    if (!pristine || !work || !starts) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < SUMMARY_LOOKUPS; i++) starts[i] = rng() % SUMMARY_BITS;
+
+    printf("summary: %llu-bit bitmap, %d random lookups, %d first-fit allocations from bit 0\n",
+           SUMMARY_BITS, SUMMARY_LOOKUPS, SUMMARY_FIRST_FIT);
+    printf("%-10s %9s %13s %13s %9s %13s %13s %9s\n", "occupancy", "build ms",
+           "scan ns/find", "summ ns/find", "speedup", "scan ns/alloc", "summ ns/alloc", "speedup");
+    for (size_t o = 0; o < sizeof(occupancies) / sizeof(occupancies[0]); o++) {
+        fill_bitmap(pristine, SUMMARY_BITS, occupancies[o]);
+
+        bitmap_t plain, summ;
+        memcpy(work, pristine, SUMMARY_BITS / 8);
+        bitmap_init(&plain, work, SUMMARY_BITS);
+        double scan_find, scan_alloc;
+        summary_run(&plain, starts, &scan_find, &scan_alloc);
+
+        memcpy(work, pristine, SUMMARY_BITS / 8);
+        bitmap_init(&summ, work, SUMMARY_BITS);
+        double t0 = now_sec();
+        if (bitmap_summary_build(&summ) != 0) {
+            perror("bitmap_summary_build");
+            exit(EXIT_FAILURE);
+        }
+        double build_ms = (now_sec() - t0) * 1e3;
+        double summ_find, summ_alloc;
+        summary_run(&summ, starts, &summ_find, &summ_alloc);
+        bitmap_summary_free(&summ);
+
+        printf("%-10.3f %9.2f %13.1f %13.1f %8.1fx %13.1f %13.1f %8.1fx\n", occupancies[o], build_ms,
+               scan_find, summ_find, scan_find / summ_find, scan_alloc, summ_alloc, scan_alloc / summ_alloc);
+    }
+    free(pristine);
+    free(work);
+    free(starts);
+}
+
+
+/* ---- dirent: directory-block checksum kernels vs. the per-entry loop ---- */
+
+#define DIRENT_BENCH_ENTRIES 64     // one directory block
+
+// How mkfs_check verified an entry before dirent_csum.h: copy, finalize, compare.
+static int legacy_dirent_ok(const uint8_t *de) {
+    uint8_t tmp[DIRENT_CSUM_ENTRY];
+    memcpy(tmp, de, sizeof(tmp));
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) x ^= tmp[i];
+    tmp[63] = x;
+    return tmp[63] == de[63];
+}
+
+// Entries per second verifying (or, with finalize, recomputing) every block of buf.
+static double dirent_run(dirent_xor_fn fn, uint8_t *buf, size_t blocks, int finalize) {
+    const size_t block_bytes = DIRENT_BENCH_ENTRIES * DIRENT_CSUM_ENTRY;
+    int reps = 1;
+    for (;;) {
+        double t0 = now_sec();
+        for (int r = 0; r < reps; r++) {
+            for (size_t b = 0; b < blocks; b++) {
+                uint8_t *blk = buf + b * block_bytes;
+                uint64_t bad = 0;
+                if (!fn) {
+                    for (int e = 0; e < DIRENT_BENCH_ENTRIES; e++)
+                        bad |= (uint64_t)!legacy_dirent_ok(blk + e * DIRENT_CSUM_ENTRY) << e;
+                    sink += bad;
+                    continue;
+                }
+                uint8_t x[DIRENT_BENCH_ENTRIES];
+                fn(blk, DIRENT_BENCH_ENTRIES, x);
+                for (int e = 0; e < DIRENT_BENCH_ENTRIES; e++) {
+                    if (finalize) blk[e * DIRENT_CSUM_ENTRY + DIRENT_CSUM_ENTRY - 1] ^= x[e];
+                    else bad |= (uint64_t)(x[e] != 0) << e;
+                }
+                sink += bad;
+            }
+        }
+        double t = now_sec() - t0;
+        if (t > 0.2 || reps >= (1 << 24)) return (double)reps * blocks * DIRENT_BENCH_ENTRIES / t;
+        reps *= 2;
+    }
+}
+
+static void bench_dirent(void) {
+    static const size_t sizes[] = {16, 16384};     // 64 KiB (cache resident) and 64 MiB of directory blocks
+    const struct {
+        const char *name;
+        dirent_xor_fn fn;
+        int usable;
+    } impls[] = {
+        {"legacy", NULL, 1},
+        {"bytes", dirent_xor_bytes, 1},
+        {"scalar", dirent_xor_scalar, 1},
+#ifdef DIRENT_CSUM_HAVE_X86
+        {"sse2", dirent_xor_sse2, __builtin_cpu_supports("sse2")},
+        {"avx2", dirent_xor_avx2, __builtin_cpu_supports("avx2")},
+#endif
+    };
+    size_t max_bytes = sizes[1] * DIRENT_BENCH_ENTRIES * DIRENT_CSUM_ENTRY;
+    uint8_t *buf = malloc(max_bytes);
+    if (!buf) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < max_bytes; i++) buf[i] = (uint8_t)rng();
+    dirent_block_finalize(buf, max_bytes / DIRENT_CSUM_ENTRY);
+
+    printf("dirent: %d-entry directory blocks, selected kernel: %s\n", DIRENT_BENCH_ENTRIES, dirent_csum_impl());
+    printf("%-8s %10s %16s %16s %9s\n", "kernel", "blocks", "verify Ment/s", "finalize Ment/s", "speedup");
+    for (size_t z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++) {
+        double legacy = 0;
+        for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+            if (!impls[k].usable) continue;
+            double verify = dirent_run(impls[k].fn, buf, sizes[z], 0);
+            if (!impls[k].fn) legacy = verify;
+            if (impls[k].fn) {
+                double fin = dirent_run(impls[k].fn, buf, sizes[z], 1);
+                printf("%-8s %10zu %16.1f %16.1f %8.1fx\n", impls[k].name, sizes[z], verify / 1e6, fin / 1e6,
+                       verify / legacy);
+            } else {
+                printf("%-8s %10zu %16.1f %16s %9s\n", impls[k].name, sizes[z], verify / 1e6, "-", "-");
+            }
+        }
+    }
+    free(buf);
+}
+
+
+/* ---- csum: IEEE CRC32 vs. CRC32C kernels on the sizes the tools checksum ---- */
+
+// Nanoseconds per checksum of 'len' bytes, cycling through 'count' inputs of buf.
+static double csum_run(crc32_update_fn fn, const uint8_t *buf, size_t len, size_t count) {
+    int reps = 1;
+    for (;;) {
+        double t0 = now_sec();
+        uint32_t acc = 0;
+        for (int r = 0; r < reps; r++)
+            for (size_t i = 0; i < count; i++) acc ^= fn(0xFFFFFFFFu, buf + i * len, len);
+        sink += acc;
+        double t = now_sec() - t0;
+        if (t > 0.2 || reps >= (1 << 24)) return t * 1e9 / ((double)reps * count);
+        reps *= 2;
+    }
+}
+
+static void bench_csum(void) {
+    const struct {
+        const char *name;
+        size_t len, count;
+    } loads[] = {
+        {"inode", 120, 32768},          // a 4 MiB inode table, inode by inode
+        {"superblock", BS - 4, 1},
+        {"data block", BS, 16384},      // 64 MiB of file data, past the caches
+    };
+    const struct {
+        const char *name;
+        crc32_update_fn fn;
+        int crc32c;
+        int usable;
+    } impls[] = {
+        {"crc32/table", crc32_update_table, 0, 1},
+#ifdef CRC32_HAVE_SLICING
+        {"crc32/slice16", crc32_update_slice16, 0, 1},
+#endif
+#ifdef CRC32_HAVE_X86
+        {"crc32/pclmul", crc32_update_pclmul, 0, crc32_cpu_has_pclmul()},
+#endif
+        {"crc32c/table", crc32c_update_table, 1, 1},
+#ifdef CRC32_HAVE_SLICING
+        {"crc32c/slice8", crc32c_update_slice8, 1, 1},
+#endif
+#ifdef CRC32_HAVE_X86
+        {"crc32c/sse4.2", crc32c_update_sse42, 1, crc32_cpu_has_sse42()},
+#endif
+    };
+    size_t max_bytes = BS * 16384;
+    uint8_t *buf = malloc(max_bytes);
+    if (!buf) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < max_bytes; i++) buf[i] = (uint8_t)rng();
+
+    printf("csum: selected crc32: %s, crc32c: %s; speedup is against crc32/table, the v1 loop\n",
+           crc32_impl(), crc32c_impl());
+    printf("%-11s %-14s %12s %10s %9s\n", "input", "kernel", "ns/checksum", "GB/s", "speedup");
+    for (size_t l = 0; l < sizeof(loads) / sizeof(loads[0]); l++) {
+        double base = 0;
+        for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+            if (!impls[k].usable) continue;
+            // A kernel that disagrees with the dispatched checksum is not worth timing.
+            uint32_t want = impls[k].crc32c ? crc32c(buf, loads[l].len) : crc32(buf, loads[l].len);
+            if ((impls[k].fn(0xFFFFFFFFu, buf, loads[l].len) ^ 0xFFFFFFFFu) != want) {
+                printf("%-11s %-14s %12s\n", loads[l].name, impls[k].name, "WRONG");
+                continue;
+            }
+            double ns = csum_run(impls[k].fn, buf, loads[l].len, loads[l].count);
+            if (k == 0) base = ns;
+            printf("%-11s %-14s %12.1f %10.2f %8.1fx\n", loads[l].name, impls[k].name, ns, loads[l].len / ns,
+                   base / ns);
+        }
+    }
+    free(buf);
+}
+
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} benches[] = {
+    {"alloc", bench_alloc},
+    {"summary", bench_summary},
+    {"dirent", bench_dirent},
+    {"csum", bench_csum},
+};
+
+int main(int argc, char *argv[]) {
+    size_t n = sizeof(benches) / sizeof(benches[0]);
+    int ran = 0;
+    for (size_t i = 0; i < n; i++) {
+        int wanted = argc < 2;
+        for (int a = 1; a < argc; a++) wanted |= strcmp(argv[a], benches[i].name) == 0;
+        if (wanted) {
+            benches[i].run();
+            ran++;
+        }
+    }
+    if (!ran) {
+        fprintf(stderr, "Usage: mkfs_bench [benchmark...]\n  benchmarks:");
+        for (size_t i = 0; i < n; i++) fprintf(stderr, " %s", benches[i].name);
+        fprintf(stderr, "\n");
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -1,329 +1,1127 @@
-#define _FILE_OFFSET_BITS 64
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <string.h>
-#include <inttypes.h>
-#include <errno.h>
-#include <time.h>
-#include <assert.h>
-#include <getopt.h>
-#include <unistd.h>
-#include <fcntl.h>
-
-
-#define BS 4096u
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
-
-
-uint64_t g_random_seed = 0;
-
-
-#pragma pack(push, 1)
-typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    uint32_t block_size;
-    uint64_t total_blocks;
-    uint64_t inode_count;
-    uint64_t inode_bitmap_start;
-    uint64_t inode_bitmap_blocks;
-    uint64_t data_bitmap_start;
-    uint64_t data_bitmap_blocks;
-    uint64_t inode_table_start;
-    uint64_t inode_table_blocks;
-    uint64_t data_region_start;
-    uint64_t data_region_blocks;
-    uint64_t root_inode;
-    uint64_t mtime_epoch;
-    uint32_t flags;
-    uint32_t checksum;
-} superblock_t;
-#pragma pack(pop)
-
-
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
-
-
-#pragma pack(push,1)
-typedef struct {
-    uint16_t mode;
-    uint16_t links;
-    uint32_t uid;
-    uint32_t gid;
-    uint64_t size_bytes;
-    uint64_t atime;
-    uint64_t mtime;
-    uint64_t ctime;
-    uint32_t direct[12];
-    uint32_t reserved_0;
-    uint32_t reserved_1;
-    uint32_t reserved_2;
-    uint32_t proj_id;
-    uint32_t uid16_gid16;
-    uint64_t xattr_ptr;
-    uint64_t inode_crc;
-} inode_t;
-#pragma pack(pop)
-
-
-_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
-
-
-#pragma pack(push,1)
-typedef struct {
-    uint32_t inode_no;
-    uint8_t type;
-    char name[58];
-    uint8_t checksum;
-} dirent64_t;
-#pragma pack(pop)
-
-
-_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
-
-
-uint32_t CRC32_TAB[256];
-
-
-void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
-    }
-}
-
-
-uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
-}
-
-
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *) sb, BS - 4);
-    sb->checksum = s;
-    return s;
-}
-
-
-void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c;
-}
-
-
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];
-    de->checksum = x;
-}
-
-
-void usage() {
-    fprintf(stderr, "Usage: mkfs_builder --image <filename> --size-kib <size> --inodes <count>\n");
-    fprintf(stderr, "  --size-kib: 180-4096, multiple of 4\n");
-    fprintf(stderr, "  --inodes: 128-512\n");
-}
-
-
-int main(int argc, char *argv[]) {
-    crc32_init();
-   
-    char *imageName = NULL;
-    uint64_t size_kib = 0;
-    uint64_t inodes = 0;
-   
-    static struct option long_options[] = {
-        {"image", required_argument, 0, 'i'},
-        {"size-kib", required_argument, 0, 's'},
-        {"inodes", required_argument, 0, 'n'},
-        {0, 0, 0, 0}
-    };
-   
-    int opt;
-    while ((opt = getopt_long(argc, argv, "i:s:n:", long_options, NULL)) != -1) {
-        switch (opt) {
-            case 'i': imageName = optarg; break;
-            case 's': size_kib = atoll(optarg); break;
-            case 'n': inodes = atoll(optarg); break;
-            default:
-                usage();
-                exit(EXIT_FAILURE);
-        }
-    }
-   
-    if (!imageName || size_kib < 180 || size_kib > 4096 ||
-        inodes < 128 || inodes > 512 || (size_kib % 4 != 0)) {
-        usage();
-        exit(EXIT_FAILURE);
-    }
-   
-    uint64_t total_blocks = size_kib * 1024 / BS;
-    uint64_t inode_table_blocks = (inodes * INODE_SIZE + BS - 1) / BS;
-    uint64_t data_region_start = 3 + inode_table_blocks;
-    uint64_t data_region_blocks = total_blocks - data_region_start;
-   
-    if (data_region_blocks < 1) {
-        fprintf(stderr, "File system too small for layout\n");
-        exit(EXIT_FAILURE);
-    }
-   
-    time_t now = time(NULL);
-   
-    superblock_t sb = {
-        .magic = 0x4D565346,
-        .version = 1,
-        .block_size = BS,
-        .total_blocks = total_blocks,
-        .inode_count = inodes,
-        .inode_bitmap_start = 1,
-        .inode_bitmap_blocks = 1,
-        .data_bitmap_start = 2,
-        .data_bitmap_blocks = 1,
-        .inode_table_start = 3,
-        .inode_table_blocks = inode_table_blocks,
-        .data_region_start = data_region_start,
-        .data_region_blocks = data_region_blocks,
-        .root_inode = 1,
-        .mtime_epoch = now,
-        .flags = 0
-    };
-    superblock_crc_finalize(&sb);
-   
-    FILE *fp = fopen(imageName, "wb");
-    if (!fp) {
-        perror("Failed to create image file");
-        exit(EXIT_FAILURE);
-    }
-
-
-   
-    uint8_t superblock_buffer[BS] = {0};
-    memcpy(superblock_buffer, &sb, sizeof(sb));
-    if (fwrite(superblock_buffer, BS, 1, fp) != 1) {
-        perror("Superblock writen failed");
-        fclose(fp);
-        exit(EXIT_FAILURE);
-    }
-
-
-    uint8_t inode_bitmap[BS] = {0};
-    inode_bitmap[0] = 0x01;
-    if (fwrite(inode_bitmap, BS, 1, fp) != 1) {
-        perror("Failed to write inode bitmap");
-        fclose(fp);
-        exit(EXIT_FAILURE);
-    }
-
-
-
-
-    uint8_t data_bitmap[BS] = {0};
-    data_bitmap[0] = 0x01;
-    if (fwrite(data_bitmap, BS, 1, fp) != 1) {
-        perror("Failed to write data bitmap");
-        fclose(fp);
-        exit(EXIT_FAILURE);
-    }
-
-
-
-
-    uint8_t *inode_table = calloc(inode_table_blocks, BS);
-    if (!inode_table) {
-        perror("Failed to allocate inode table");
-        fclose(fp);
-        exit(EXIT_FAILURE);
-    }
-
-
-    inode_t *root_inode = (inode_t *)(inode_table);
-    root_inode->mode = 0x4000;
-    root_inode->links = 2;    
-    root_inode->uid = 0;
-    root_inode->gid = 0;
-    root_inode->size_bytes = 2 * sizeof(dirent64_t);
-    root_inode->atime = now;
-    root_inode->mtime = now;
-    root_inode->ctime = now;
-    root_inode->direct[0] = data_region_start;
-    for (int i = 1; i < 12; i++) root_inode->direct[i] = 0;
-    root_inode->proj_id = 1234;
-    inode_crc_finalize(root_inode);
-
-
-    if (fwrite(inode_table, BS, inode_table_blocks, fp) != inode_table_blocks) {
-        perror("Failed to write inode table");
-        free(inode_table);
-        fclose(fp);
-        exit(EXIT_FAILURE);
-    }
-    free(inode_table);
-
-
-   
-    uint8_t *data_region = calloc(data_region_blocks, BS);
-    if (!data_region) {
-        perror("Failed to allocate data region");
-        fclose(fp);
-        exit(EXIT_FAILURE);
-    }
-
-
-   
-    dirent64_t *entries = (dirent64_t *)data_region;
-
-
-
-
-    entries[0].inode_no = 1;
-    entries[0].type = 2;
-    strncpy(entries[0].name, ".", sizeof(entries[0].name));
-    dirent_checksum_finalize(&entries[0]);
-
-
-
-
-    entries[1].inode_no = 1;
-    entries[1].type = 2;
-    strncpy(entries[1].name, "..", sizeof(entries[1].name));
-    dirent_checksum_finalize(&entries[1]);
-
-
-    if (fwrite(data_region, BS, data_region_blocks, fp) != data_region_blocks) {
-        perror("Failed to write data region");
-        free(data_region);
-        fclose(fp);
-        exit(EXIT_FAILURE);
-    }
-    free(data_region);
-
-
-
-
-    long current_pos = ftell(fp);
-    long expected_size = total_blocks * BS;
-    if (current_pos != expected_size) {
-        fprintf(stderr, "File size incorrect: %ld bytes (expected: %ld bytes)\n",
-                current_pos, expected_size);
-        fclose(fp);
-        exit(EXIT_FAILURE);
-    }
-
-
-    fclose(fp);
-   
-    printf("File system created successfully: %s\n", imageName);
-    printf("  Size: %" PRIu64 " KiB, Inodes: %" PRIu64 ", Blocks: %" PRIu64 "\n",
-           size_kib, inodes, total_blocks);
-   
-    return 0;
-}
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "minivsfs.h"
+#include "thread_pool.h"
+
+
+#define BITS_PER_BLOCK ((uint64_t)BS * 8)
+
+// Block numbers are 32-bit in inodes, so an image holds fewer than 2^32 blocks.
+#define MIN_SIZE_KIB 180ull
+#define MAX_SIZE_KIB (((1ull << 32) - 1) * (BS / 1024) / 4 * 4)
+#define MIN_INODES 128ull
+#define MAX_INODES 0xFFFFFFFFull
+#define MAX_GROUPS 65536ull
+
+
+uint64_t g_random_seed = 0;
+
+
+void usage() {
+    fprintf(stderr, "Usage: mkfs_builder --image <filename> --size-kib <size> --inodes <count> [--dense] "
+                    "[--data-csum] [--checksum crc32|crc32c] [--groups <n> | --populate <dir> [--threads <n>]]\n");
+    fprintf(stderr, "  --size-kib: %llu-%llu, multiple of 4\n",
+            (unsigned long long)MIN_SIZE_KIB, (unsigned long long)MAX_SIZE_KIB);
+    fprintf(stderr, "  --inodes: %llu-%llu\n", (unsigned long long)MIN_INODES, (unsigned long long)MAX_INODES);
+    fprintf(stderr, "  --dense: write every block instead of leaving unused ones as holes\n");
+    fprintf(stderr, "  --data-csum: keep a CRC32C of every data block in a table at the end of the image\n");
+    fprintf(stderr, "  --checksum: superblock and inode checksum algorithm (default crc32, readable by v1 tools)\n");
+    fprintf(stderr, "  --groups: split inodes and data blocks into n allocation groups (1-%llu, default 1)\n",
+            (unsigned long long)MAX_GROUPS);
+    fprintf(stderr, "  --populate: copy the tree under <dir> into the new image\n");
+    fprintf(stderr, "  --threads: workers reading host files for --populate, or writing a --dense image "
+                    "(default: online CPUs)\n");
+}
+
+
+int write_blocks(int fd, const uint8_t *buf, uint64_t block, uint64_t count) {
+    for (size_t done = 0; done < count * BS; ) {
+        ssize_t n = pwrite(fd, buf + done, count * BS - done, (off_t)(block * BS + done));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+int write_block(int fd, const uint8_t *buf, uint64_t block) {
+    return write_blocks(fd, buf, block, 1);
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Dense writer for large images: the image is cut into ranges of
+ * REGION_WRITER_BLOCKS blocks and a thread pool writes them concurrently
+ * with pwrite(), which needs no shared file offset. All-zero stretches
+ * (nearly everything in a fresh image) are allocated with
+ * fallocate(FALLOC_FL_ZERO_RANGE) instead of being copied from a zero
+ * buffer; a file system without it gets the zeros written. Each worker
+ * counts the bytes it wrote and the bytes it only zero-ranged, separately,
+ * so the split of real work is visible afterwards. Every dense image without
+ * --populate goes through here, one worker included, so thread counts compare
+ * like with like.
+ */
+#define REGION_WRITER_BLOCKS 2048u      // 8 MiB per task
+#define REGION_ZERO_BLOCKS 256u         // zeros written per pwrite() without ZERO_RANGE
+
+typedef struct {
+    uint64_t block;
+    const uint8_t *buf;
+    const char *what;
+} meta_block_t;
+
+typedef struct {
+    uint64_t written;           // bytes copied with pwrite()
+    uint64_t zeroed;            // bytes allocated with FALLOC_FL_ZERO_RANGE
+} region_bytes_t;
+
+typedef struct {
+    int fd;
+    uint64_t total_blocks;
+    const meta_block_t *meta;   // sorted by block
+    size_t nmeta;
+    int zero_range;             // cleared once fallocate() turns out to be unsupported
+    int err;                    // first errno
+    region_bytes_t *bytes;      // per worker
+} region_writer_t;
+
+static int region_zero(region_writer_t *rw, uint64_t block, uint64_t count, region_bytes_t *bytes) {
+    static const uint8_t zeros[REGION_ZERO_BLOCKS * BS];
+    if (__atomic_load_n(&rw->zero_range, __ATOMIC_RELAXED)) {
+        if (fallocate(rw->fd, FALLOC_FL_ZERO_RANGE, (off_t)(block * BS), (off_t)(count * BS)) == 0) {
+            bytes->zeroed += count * BS;
+            return 0;
+        }
+        if (errno != EOPNOTSUPP && errno != ENOSYS) return -1;
+        __atomic_store_n(&rw->zero_range, 0, __ATOMIC_RELAXED);
+    }
+    for (uint64_t done = 0; done < count; ) {
+        uint64_t n = count - done < REGION_ZERO_BLOCKS ? count - done : REGION_ZERO_BLOCKS;
+        if (write_blocks(rw->fd, zeros, block + done, n) != 0) return -1;
+        bytes->written += n * BS;
+        done += n;
+    }
+    return 0;
+}
+
+static void region_write_task(void *arg, size_t task, int worker) {
+    region_writer_t *rw = arg;
+    uint64_t start = (uint64_t)task * REGION_WRITER_BLOCKS;
+    uint64_t end = start + REGION_WRITER_BLOCKS < rw->total_blocks ? start + REGION_WRITER_BLOCKS : rw->total_blocks;
+    size_t m = 0;
+    while (m < rw->nmeta && rw->meta[m].block < start) m++;
+    for (uint64_t block = start; block < end; ) {
+        int rc;
+        uint64_t count;
+        if (m < rw->nmeta && rw->meta[m].block == block) {
+            rc = write_block(rw->fd, rw->meta[m++].buf, block);
+            count = 1;
+            if (rc == 0) rw->bytes[worker].written += BS;
+        } else {
+            uint64_t next = m < rw->nmeta && rw->meta[m].block < end ? rw->meta[m].block : end;
+            count = next - block;
+            rc = region_zero(rw, block, count, &rw->bytes[worker]);
+        }
+        if (rc != 0) {
+            int expected = 0;
+            __atomic_compare_exchange_n(&rw->err, &expected, errno ? errno : EIO, 0, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED);
+            return;
+        }
+        block += count;
+    }
+}
+
+// Writes every block of a dense image with 'threads' workers; bytes[] gets each worker's share.
+static int region_write_image(int fd, uint64_t total_blocks, const meta_block_t *meta, size_t nmeta, int threads,
+                              region_bytes_t *bytes) {
+    size_t ntasks = (total_blocks + REGION_WRITER_BLOCKS - 1) / REGION_WRITER_BLOCKS;
+    region_writer_t rw = { .fd = fd, .total_blocks = total_blocks, .meta = meta, .nmeta = nmeta,
+                           .zero_range = 1, .bytes = bytes };
+    if (ftruncate(fd, (off_t)(total_blocks * BS)) != 0) {
+        perror("Failed to size image file");
+        return -1;
+    }
+    pool_t pool;
+    if (pool_start(&pool, threads, ntasks, region_write_task, &rw) != 0) {
+        fprintf(stderr, "Failed to start writer threads\n");
+        return -1;
+    }
+    int rc = 0;
+    for (size_t t = 0; t < ntasks && rc == 0; t++) {
+        rc = pool_submit(&pool, t);
+        if (rc != 0) fprintf(stderr, "Failed to queue work\n");
+    }
+    pool_stop(&pool);
+    if (rw.err) {
+        fprintf(stderr, "Failed to write image: %s\n", strerror(rw.err));
+        rc = -1;
+    }
+    return rc;
+}
+
+
+/*
+ * --populate: build an image holding a copy of a host directory tree.
+ *
+ * The tree is walked and sorted first, and everything is laid out from that
+ * sorted order alone: inode numbers follow a preorder walk (root = 1) and
+ * every object gets one contiguous run of data blocks, in the same order, so
+ * the same tree always gives the same image whatever the thread count. Each
+ * file's run holds its indirect blocks in front of the data they map, as
+ * mkfs_adder lays them out.
+ *
+ * The work then goes to a work-stealing pool in two phases: building and
+ * checksumming inodes and directory blocks, then reading file contents in
+ * chunks of up to POPULATE_CHUNK_BLOCKS. A single writer emits the image
+ * front to back in one sequential pass, taking chunks in order as they
+ * complete while the pool reads ahead up to POPULATE_WINDOW bytes. With a
+ * data checksum table the pool also checksums every block it reads; the
+ * table goes out last, after the data it covers.
+ */
+#define POPULATE_CHUNK_BLOCKS 256u
+#define POPULATE_WINDOW (64u << 20)
+#define POPULATE_META_NODES 1024u
+
+typedef struct {
+    char *host_path;
+    char name[58];
+    int is_dir;
+    uint32_t parent;        // node index; the root is node 0 and its own parent
+    uint64_t size;          // bytes in the inode
+    uint64_t nblocks;       // data blocks (directory: 1, or the bucket count)
+    uint64_t start;         // first block of the object's run
+    uint32_t first_child;   // into children[]
+    uint32_t nchildren;
+    uint8_t *dir_data;      // directory blocks, built in phase 1
+} pop_node_t;
+
+typedef struct {
+    uint32_t node;
+    uint64_t first, count;  // blocks of the node's run
+    uint8_t *buf;
+    int err;                // errno, or -1 if the file shrank
+} pop_chunk_t;
+
+typedef struct {
+    pop_node_t *nodes;
+    uint32_t count, cap;
+    uint32_t *children;     // child node indices, grouped per directory, sorted
+    uint8_t *inode_table;
+    uint32_t flags;         // superblock flags, which pick the inode checksum
+    time_t now;
+    pop_chunk_t *chunks;
+    size_t nchunks;
+    uint32_t *csum;         // checksum table entries of the blocks in use, or NULL
+    uint64_t data_start;    // data_region_start
+} populate_t;
+
+static int cmp_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int64_t pop_add_node(populate_t *pop, const char *host_path, const char *name, uint32_t parent, int is_dir,
+                            uint64_t size) {
+    if (pop->count == pop->cap) {
+        uint32_t cap = pop->cap ? pop->cap * 2 : 256;
+        pop_node_t *nodes = realloc(pop->nodes, (size_t)cap * sizeof(*nodes));
+        if (!nodes) {
+            perror("Failed to grow file list");
+            return -1;
+        }
+        pop->nodes = nodes;
+        pop->cap = cap;
+    }
+    pop_node_t *n = &pop->nodes[pop->count];
+    memset(n, 0, sizeof(*n));
+    n->host_path = strdup(host_path);
+    if (!n->host_path) {
+        perror("Failed to copy path");
+        return -1;
+    }
+    strncpy(n->name, name, sizeof(n->name) - 1);
+    n->is_dir = is_dir;
+    n->parent = parent;
+    n->size = size;
+    return pop->count++;
+}
+
+// Adds the entries of directory node 'dir' in name order, each directory directly followed by its contents.
+static int pop_walk(populate_t *pop, uint32_t dir) {
+    const char *path = pop->nodes[dir].host_path;
+    DIR *d = opendir(path);
+    if (!d) {
+        fprintf(stderr, "Failed to open directory '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    char **names = NULL;
+    size_t count = 0, cap = 0;
+    struct dirent *de;
+    int rc = 0;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            char **grown = realloc(names, cap * sizeof(*names));
+            if (!grown) {
+                perror("Failed to list directory");
+                rc = -1;
+                break;
+            }
+            names = grown;
+        }
+        if (!(names[count] = strdup(de->d_name))) {
+            perror("Failed to list directory");
+            rc = -1;
+            break;
+        }
+        count++;
+    }
+    closedir(d);
+    qsort(names, count, sizeof(*names), cmp_names);
+
+    for (size_t i = 0; i < count && rc == 0; i++) {
+        size_t len = strlen(path) + 1 + strlen(names[i]) + 1;
+        char *child_path = malloc(len);
+        if (!child_path) {
+            perror("Failed to build path");
+            rc = -1;
+            break;
+        }
+        snprintf(child_path, len, "%s/%s", path, names[i]);
+        struct stat st;
+        if (lstat(child_path, &st) != 0) {
+            fprintf(stderr, "Failed to stat '%s': %s\n", child_path, strerror(errno));
+            rc = -1;
+        } else if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "Skipping '%s': not a regular file or directory\n", child_path);
+        } else if (strlen(names[i]) > 57) {
+            fprintf(stderr, "Name too long (max 57 bytes): %s\n", child_path);
+            rc = -1;
+        } else {
+            int64_t n = pop_add_node(pop, child_path, names[i], dir, S_ISDIR(st.st_mode),
+                                     S_ISREG(st.st_mode) ? (uint64_t)st.st_size : 0);
+            if (n < 0 || (S_ISDIR(st.st_mode) && pop_walk(pop, n) != 0)) rc = -1;
+        }
+        free(child_path);
+    }
+    for (size_t i = 0; i < count; i++) free(names[i]);
+    free(names);
+    return rc;
+}
+
+/*
+ * Places a directory's entries in a hashed layout of nbuckets buckets the way
+ * mkfs_adder's dir_rehash() does ("." and ".." first in bucket 0, each entry
+ * in the first bucket with room within DIR_HASH_PROBES of its hash). With
+ * out == NULL it only checks that everything fits. Returns 0 if it does; the
+ * entries are written without checksums.
+ */
+static int pop_hash_place(const populate_t *pop, const pop_node_t *dir, uint64_t nbuckets,
+                          uint8_t *counts, dirent64_t *out) {
+    memset(counts, 0, nbuckets);
+    counts[0] = 2;
+    for (uint32_t c = 0; c < dir->nchildren; c++) {
+        uint32_t child = pop->children[dir->first_child + c];
+        uint32_t h = dirent_name_hash(pop->nodes[child].name);
+        uint64_t p;
+        for (p = 0; p < DIR_HASH_PROBES && p < nbuckets; p++) {
+            uint64_t b = (h + p) & (nbuckets - 1);
+            if (counts[b] < DIRENTS_PER_BLOCK) {
+                if (out) {
+                    dirent64_t *de = &out[b * DIRENTS_PER_BLOCK + counts[b]];
+                    de->inode_no = child + 1;
+                    de->type = pop->nodes[child].is_dir ? DIRENT_DIR : DIRENT_FILE;
+                    memcpy(de->name, pop->nodes[child].name, sizeof(de->name));
+                }
+                counts[b]++;
+                break;
+            }
+        }
+        if (p == DIR_HASH_PROBES || p == nbuckets) return -1;
+    }
+    return 0;
+}
+
+// Position within an object's run of its data block k (indirect blocks sit in front of what they map).
+static uint64_t pop_data_pos(uint64_t k) {
+    if (k < N_DIRECT) return k;
+    if (k < N_DIRECT + PTRS_PER_BLOCK) return k + 1;
+    uint64_t rel = k - N_DIRECT - PTRS_PER_BLOCK;
+    return N_DIRECT + 1 + PTRS_PER_BLOCK + 1 + rel / PTRS_PER_BLOCK * (PTRS_PER_BLOCK + 1) + 1 + rel % PTRS_PER_BLOCK;
+}
+
+/*
+ * Block r of a run with nblocks data blocks starting at 'start': returns 1 and
+ * sets *k if it is data block k, otherwise fills buf (if given) with the indirect block.
+ */
+static int pop_run_block(uint64_t start, uint64_t nblocks, uint64_t r, uint64_t *k, uint8_t *buf) {
+    uint64_t first = 0, count = 0;     // data blocks an indirect block maps
+    uint64_t dbl_groups = 0;
+    if (r < N_DIRECT) {
+        *k = r;
+        return 1;
+    } else if (r == N_DIRECT) {
+        first = N_DIRECT;
+        count = PTRS_PER_BLOCK;
+    } else if (r < N_DIRECT + 1 + PTRS_PER_BLOCK) {
+        *k = r - 1;
+        return 1;
+    } else if (r == N_DIRECT + 1 + PTRS_PER_BLOCK) {
+        dbl_groups = (nblocks - N_DIRECT - PTRS_PER_BLOCK + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+    } else {
+        uint64_t q = r - (N_DIRECT + 2 + PTRS_PER_BLOCK);
+        uint64_t g = q / (PTRS_PER_BLOCK + 1), o = q % (PTRS_PER_BLOCK + 1);
+        if (o != 0) {
+            *k = N_DIRECT + PTRS_PER_BLOCK + g * PTRS_PER_BLOCK + o - 1;
+            return 1;
+        }
+        first = N_DIRECT + PTRS_PER_BLOCK + g * PTRS_PER_BLOCK;
+        count = PTRS_PER_BLOCK;
+    }
+    if (!buf) return 0;
+    uint32_t *ptrs = (uint32_t *)buf;
+    memset(buf, 0, BS);
+    for (uint64_t i = 0; i < count && first + i < nblocks; i++) ptrs[i] = start + pop_data_pos(first + i);
+    for (uint64_t g = 0; g < dbl_groups; g++)
+        ptrs[g] = start + N_DIRECT + 2 + PTRS_PER_BLOCK + g * (PTRS_PER_BLOCK + 1);
+    return 0;
+}
+
+// Phase 1: inodes and directory blocks of nodes [task * POPULATE_META_NODES, ...).
+static void pop_meta_task(void *arg, size_t task, int worker) {
+    (void)worker;
+    populate_t *pop = arg;
+    uint32_t end = (task + 1) * POPULATE_META_NODES;
+    if (end > pop->count) end = pop->count;
+    for (uint32_t i = task * POPULATE_META_NODES; i < end; i++) {
+        pop_node_t *n = &pop->nodes[i];
+        inode_t *ino = (inode_t *)(pop->inode_table + (uint64_t)i * INODE_SIZE);
+        ino->mode = n->is_dir ? MODE_DIR : MODE_FILE;
+        ino->links = n->is_dir ? 2 + n->nchildren : 1;
+        ino->size_bytes = n->size;
+        ino->atime = ino->mtime = ino->ctime = pop->now;
+        ino->proj_id = 1234;
+        for (uint64_t k = 0; k < n->nblocks && k < N_DIRECT; k++) ino->direct[k] = n->start + pop_data_pos(k);
+        if (n->nblocks > N_DIRECT) ino->reserved_1 = n->start + N_DIRECT;
+        if (n->nblocks > N_DIRECT + PTRS_PER_BLOCK) ino->reserved_2 = n->start + N_DIRECT + 1 + PTRS_PER_BLOCK;
+
+        if (n->is_dir) {
+            dirent64_t *de = (dirent64_t *)n->dir_data;
+            de[0].inode_no = i + 1;
+            de[0].type = DIRENT_DIR;
+            strcpy(de[0].name, ".");
+            de[1].inode_no = n->parent + 1;
+            de[1].type = DIRENT_DIR;
+            strcpy(de[1].name, "..");
+            if (n->nblocks > 1) {
+                // Hashed; the scratch bucket counts live just past the blocks.
+                ino->reserved_0 = INODE_F_HASHDIR;
+                pop_hash_place(pop, n, n->nblocks, n->dir_data + n->nblocks * BS, de);
+            } else {
+                for (uint32_t c = 0; c < n->nchildren; c++) {
+                    uint32_t child = pop->children[n->first_child + c];
+                    de[2 + c].inode_no = child + 1;
+                    de[2 + c].type = pop->nodes[child].is_dir ? DIRENT_DIR : DIRENT_FILE;
+                    memcpy(de[2 + c].name, pop->nodes[child].name, sizeof(de[2 + c].name));
+                }
+            }
+            // Free slots are all zero, so finalizing them leaves them zero.
+            dirent_block_finalize(de, n->nblocks * DIRENTS_PER_BLOCK);
+        }
+        inode_crc_finalize(ino, pop->flags);
+    }
+}
+
+// Phase 2: reads one chunk of a file's run, building its indirect blocks alongside.
+static void pop_data_task(void *arg, size_t task, int worker) {
+    (void)worker;
+    populate_t *pop = arg;
+    pop_chunk_t *c = &pop->chunks[task];
+    const pop_node_t *n = &pop->nodes[c->node];
+    c->buf = malloc(c->count * BS);
+    if (!c->buf) {
+        c->err = ENOMEM;
+        return;
+    }
+    int fd = open(n->host_path, O_RDONLY);
+    if (fd < 0) {
+        c->err = errno;
+        return;
+    }
+    for (uint64_t r = c->first; r < c->first + c->count && !c->err; ) {
+        uint8_t *dst = c->buf + (r - c->first) * BS;
+        uint64_t k;
+        if (!pop_run_block(n->start, n->nblocks, r, &k, dst)) {
+            r++;
+            continue;
+        }
+        // Read the run of consecutive data blocks starting here in one go.
+        uint64_t run = 1, k2;
+        while (r + run < c->first + c->count && pop_run_block(n->start, n->nblocks, r + run, &k2, NULL)) run++;
+        uint64_t off = k * BS;
+        uint64_t want = off + run * BS <= n->size ? run * BS : n->size - off;
+        for (uint64_t done = 0; done < want; ) {
+            ssize_t got = pread(fd, dst + done, want - done, off + done);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) {
+                c->err = got < 0 ? errno : -1;
+                break;
+            }
+            done += got;
+        }
+        memset(dst + want, 0, run * BS - want);
+        r += run;
+    }
+    close(fd);
+    if (pop->csum && !c->err) {
+        uint32_t *csum = pop->csum + (n->start + c->first - pop->data_start);
+        for (uint64_t r = 0; r < c->count; r++) csum[r] = crc32c(c->buf + r * BS, BS);
+    }
+}
+
+/*
+ * Writes blocks in strictly increasing order, batching neighbours into one
+ * pwrite() of up to SEQ_WRITER_BLOCKS. Skipped blocks are left as holes, or
+ * written as zeros when dense.
+ */
+#define SEQ_WRITER_BLOCKS 256u
+
+typedef struct {
+    int fd;
+    int dense;
+    uint64_t next;          // block after the last one queued
+    uint8_t *buf;
+    uint64_t len;           // blocks queued, ending at 'next'
+    uint64_t bytes_written;
+} seq_writer_t;
+
+static int seq_flush(seq_writer_t *w) {
+    if (w->len == 0) return 0;
+    if (write_blocks(w->fd, w->buf, w->next - w->len, w->len) != 0) return -1;
+    w->bytes_written += w->len * BS;
+    w->len = 0;
+    return 0;
+}
+
+static int seq_put(seq_writer_t *w, uint64_t block, const uint8_t *data, uint64_t count) {
+    static const uint8_t zero_block[BS];
+    while (w->dense && w->next < block) {
+        if (seq_put(w, w->next, zero_block, 1) != 0) return -1;
+    }
+    if (block != w->next) {
+        if (seq_flush(w) != 0) return -1;
+        w->next = block;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        memcpy(w->buf + w->len * BS, data + i * BS, BS);
+        w->len++;
+        w->next++;
+        if (w->len == SEQ_WRITER_BLOCKS && seq_flush(w) != 0) return -1;
+    }
+    return 0;
+}
+
+// Writes the blocks of a bitmap whose first 'used' bits are set; the rest stay holes or zeros.
+static int seq_put_bitmap(seq_writer_t *w, uint64_t start, uint64_t used) {
+    uint8_t block[BS];
+    for (uint64_t b = 0; b * BITS_PER_BLOCK < used; b++) {
+        uint64_t bits = used - b * BITS_PER_BLOCK < BITS_PER_BLOCK ? used - b * BITS_PER_BLOCK : BITS_PER_BLOCK;
+        memset(block, 0, BS);
+        memset(block, 0xFF, bits / 8);
+        if (bits % 8) block[bits / 8] = (uint8_t)((1u << (bits % 8)) - 1);
+        if (seq_put(w, start + b, block, 1) != 0) return -1;
+    }
+    return 0;
+}
+
+static void pop_free(populate_t *pop) {
+    for (uint32_t i = 0; i < pop->count; i++) {
+        free(pop->nodes[i].host_path);
+        free(pop->nodes[i].dir_data);
+    }
+    if (pop->chunks) {
+        for (size_t c = 0; c < pop->nchunks; c++) free(pop->chunks[c].buf);
+    }
+    free(pop->nodes);
+    free(pop->children);
+    free(pop->inode_table);
+    free(pop->chunks);
+    free(pop->csum);
+}
+
+// Walks host_dir and assigns every object its inode and block run; sets the feature flags it needs.
+static int pop_layout(populate_t *pop, superblock_t *sb, const char *host_dir) {
+    struct stat st;
+    if (stat(host_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Not a directory: %s\n", host_dir);
+        return -1;
+    }
+    if (pop_add_node(pop, host_dir, "", 0, 1, 0) < 0 || pop_walk(pop, 0) != 0) return -1;
+    if (pop->count > sb->inode_count) {
+        fprintf(stderr, "Too many files and directories (%" PRIu32 ") for %" PRIu64 " inodes\n",
+                pop->count, sb->inode_count);
+        return -1;
+    }
+
+    // Children were added in name order, so grouping them by parent keeps that order.
+    pop->children = malloc((pop->count ? pop->count : 1) * sizeof(*pop->children));
+    if (!pop->children) {
+        perror("Failed to allocate directory lists");
+        return -1;
+    }
+    for (uint32_t i = 1; i < pop->count; i++) pop->nodes[pop->nodes[i].parent].nchildren++;
+    uint32_t next = 0;
+    for (uint32_t i = 0; i < pop->count; i++) {
+        // A directory's link count (2 + entries) has to fit the inode's uint16.
+        if (pop->nodes[i].nchildren > UINT16_MAX - 2u) {
+            fprintf(stderr, "Too many entries in directory (max %u): %s\n", UINT16_MAX - 2u,
+                    pop->nodes[i].host_path);
+            return -1;
+        }
+        pop->nodes[i].first_child = next;
+        next += pop->nodes[i].nchildren;
+        pop->nodes[i].nchildren = 0;
+    }
+    for (uint32_t i = 1; i < pop->count; i++) {
+        pop_node_t *parent = &pop->nodes[pop->nodes[i].parent];
+        pop->children[parent->first_child + parent->nchildren++] = i;
+    }
+
+    uint64_t cursor = sb->data_region_start;
+    uint64_t end = sb->data_region_start + sb->data_region_blocks;
+    uint8_t *counts = NULL;
+    for (uint32_t i = 0; i < pop->count; i++) {
+        pop_node_t *n = &pop->nodes[i];
+        if (n->is_dir && n->nchildren + 2 <= DIRENTS_PER_BLOCK) {
+            n->nblocks = 1;
+            n->size = (n->nchildren + 2) * sizeof(dirent64_t);
+            n->dir_data = calloc(1, BS);
+        } else if (n->is_dir) {
+            uint64_t nbuckets = DIR_HASH_MIN_BUCKETS;
+            for (;; nbuckets *= 2) {
+                uint8_t *grown = nbuckets <= MAX_FILE_BLOCKS ? realloc(counts, nbuckets) : NULL;
+                if (!grown) {
+                    fprintf(stderr, "Directory too large: %s\n", n->host_path);
+                    free(counts);
+                    return -1;
+                }
+                counts = grown;
+                if (pop_hash_place(pop, n, nbuckets, counts, NULL) == 0) break;
+            }
+            n->nblocks = nbuckets;
+            n->size = nbuckets * BS;
+            n->dir_data = calloc(nbuckets, BS + 1);
+            sb->flags |= MVSFS_FEAT_HASHDIR;
+        } else {
+            n->nblocks = (n->size + BS - 1) / BS;
+            if (n->nblocks > MAX_FILE_BLOCKS) {
+                fprintf(stderr, "File too large - exceeds %" PRIu64 " blocks: %s\n",
+                        (uint64_t)MAX_FILE_BLOCKS, n->host_path);
+                free(counts);
+                return -1;
+            }
+        }
+        if (n->is_dir && !n->dir_data) {
+            perror("Failed to allocate directory blocks");
+            free(counts);
+            return -1;
+        }
+        if (n->nblocks > N_DIRECT) sb->flags |= MVSFS_FEAT_INDIRECT;
+        n->start = cursor;
+        uint64_t run = n->nblocks + indirect_blocks_for(n->nblocks);
+        if (run > end - cursor) {
+            fprintf(stderr, "Not enough data blocks for the contents of %s\n", host_dir);
+            free(counts);
+            return -1;
+        }
+        cursor += run;
+    }
+    free(counts);
+    return 0;
+}
+
+/*
+ * Builds the whole image for --populate into fd (already created), from the
+ * layout in sb and ext (whose counters it fills in). Returns 0 on success;
+ * counts what was copied.
+ */
+int populate_image(int fd, superblock_t *sb, const superblock_ext_t *ext, time_t now, const char *host_dir,
+                   int threads, int dense, uint64_t *bytes_written, uint64_t *files, uint64_t *dirs) {
+    populate_t pop = { .now = now, .data_start = sb->data_region_start };
+    if (pop_layout(&pop, sb, host_dir) != 0) {
+        pop_free(&pop);
+        return -1;
+    }
+    pop.flags = sb->flags;
+    pop_node_t *last = &pop.nodes[pop.count - 1];
+    uint64_t data_used = last->start + last->nblocks + indirect_blocks_for(last->nblocks) - sb->data_region_start;
+    uint64_t table_blocks = ((uint64_t)pop.count * INODE_SIZE + BS - 1) / BS;
+    uint64_t csum_blocks = (data_used + CSUM_PER_BLOCK - 1) / CSUM_PER_BLOCK;
+    *files = *dirs = 0;
+    for (uint32_t i = 0; i < pop.count; i++) {
+        if (pop.nodes[i].is_dir) (*dirs)++; else (*files)++;
+    }
+
+    // Phase 1: inodes and directory blocks, with their checksums.
+    pop.inode_table = calloc(table_blocks, BS);
+    if (sb->flags & MVSFS_FEAT_DATACSUM) pop.csum = calloc(csum_blocks, BS);
+    if (!pop.inode_table || ((sb->flags & MVSFS_FEAT_DATACSUM) && !pop.csum)) {
+        perror("Failed to allocate inode table");
+        pop_free(&pop);
+        return -1;
+    }
+    pool_t pool;
+    size_t meta_tasks = (pop.count + POPULATE_META_NODES - 1) / POPULATE_META_NODES;
+    if (pool_start(&pool, threads, meta_tasks, pop_meta_task, &pop) != 0) {
+        fprintf(stderr, "Failed to start worker threads\n");
+        pop_free(&pop);
+        return -1;
+    }
+    int rc = 0;
+    for (size_t t = 0; t < meta_tasks && rc == 0; t++) rc = pool_submit(&pool, t);
+    pool_wait_all(&pool);
+    pool_stop(&pool);
+
+    // Phase 2 work list: every file run, cut into chunks in image order.
+    for (uint32_t i = 0; i < pop.count && rc == 0; i++) {
+        const pop_node_t *n = &pop.nodes[i];
+        if (n->is_dir) continue;
+        uint64_t run = n->nblocks + indirect_blocks_for(n->nblocks);
+        for (uint64_t first = 0; first < run; first += POPULATE_CHUNK_BLOCKS) {
+            if (pop.nchunks % 1024 == 0) {
+                pop_chunk_t *grown = realloc(pop.chunks, (pop.nchunks + 1024) * sizeof(*grown));
+                if (!grown) {
+                    rc = -1;
+                    break;
+                }
+                pop.chunks = grown;
+            }
+            pop.chunks[pop.nchunks++] = (pop_chunk_t){
+                .node = i, .first = first,
+                .count = run - first < POPULATE_CHUNK_BLOCKS ? run - first : POPULATE_CHUNK_BLOCKS,
+            };
+        }
+    }
+    seq_writer_t w = { .fd = fd, .dense = dense, .buf = malloc(SEQ_WRITER_BLOCKS * BS) };
+    if (rc != 0 || !w.buf) {
+        perror("Failed to allocate work list");
+        free(w.buf);
+        pop_free(&pop);
+        return -1;
+    }
+
+    // Inodes and data blocks are handed out from the front, so the hints are the counts in use.
+    uint8_t superblock_buffer[BS] = {0};
+    memcpy(superblock_buffer, sb, sizeof(*sb));
+    superblock_ext_t *sb_ext = superblock_ext(superblock_buffer);
+    *sb_ext = *ext;
+    sb_ext->free_inodes = sb->inode_count - pop.count;
+    sb_ext->free_blocks = sb->data_region_blocks - data_used;
+    sb_ext->inode_hint = pop.count;
+    sb_ext->block_hint = data_used;
+    superblock_crc_finalize((superblock_t *)superblock_buffer);
+
+    // One pass, front to back: superblock, bitmaps, inode table, then every run in layout order.
+    if ((!dense && ftruncate(fd, (off_t)(sb->total_blocks * BS)) != 0) ||
+        seq_put(&w, 0, superblock_buffer, 1) != 0 ||
+        seq_put_bitmap(&w, sb->inode_bitmap_start, pop.count) != 0 ||
+        seq_put_bitmap(&w, sb->data_bitmap_start, data_used) != 0 ||
+        seq_put(&w, sb->inode_table_start, pop.inode_table, table_blocks) != 0) {
+        perror("Failed to write image metadata");
+        free(w.buf);
+        pop_free(&pop);
+        return -1;
+    }
+
+    if (pool_start(&pool, threads, pop.nchunks, pop_data_task, &pop) != 0) {
+        fprintf(stderr, "Failed to start worker threads\n");
+        free(w.buf);
+        pop_free(&pop);
+        return -1;
+    }
+    size_t next_chunk = 0, submitted = 0;
+    uint64_t in_flight = 0;
+    uint8_t indirect[BS];
+    for (uint32_t i = 0; i < pop.count && rc == 0; i++) {
+        const pop_node_t *n = &pop.nodes[i];
+        if (n->is_dir) {
+            uint64_t run = n->nblocks + indirect_blocks_for(n->nblocks);
+            for (uint64_t r = 0; r < run && rc == 0; r++) {
+                uint64_t k;
+                int is_data = pop_run_block(n->start, n->nblocks, r, &k, indirect);
+                const uint8_t *block = is_data ? n->dir_data + k * BS : indirect;
+                if (pop.csum) pop.csum[n->start + r - pop.data_start] = crc32c(block, BS);
+                rc = seq_put(&w, n->start + r, block, 1);
+                if (rc != 0) perror("Failed to write directory");
+            }
+            continue;
+        }
+        for (; next_chunk < pop.nchunks && pop.chunks[next_chunk].node == i && rc == 0; next_chunk++) {
+            // Keep the pool up to POPULATE_WINDOW bytes ahead of the writer.
+            while (submitted < pop.nchunks && rc == 0 &&
+                   (submitted == next_chunk || in_flight + pop.chunks[submitted].count * BS <= POPULATE_WINDOW)) {
+                rc = pool_submit(&pool, submitted);
+                in_flight += pop.chunks[submitted++].count * BS;
+            }
+            if (rc != 0) {
+                fprintf(stderr, "Failed to queue work\n");
+                break;
+            }
+            pop_chunk_t *c = &pop.chunks[next_chunk];
+            pool_wait_task(&pool, next_chunk);
+            if (c->err) {
+                fprintf(stderr, "Failed to read '%s': %s\n", n->host_path,
+                        c->err < 0 ? "file changed size while it was being copied" : strerror(c->err));
+                rc = -1;
+                break;
+            }
+            rc = seq_put(&w, n->start + c->first, c->buf, c->count);
+            if (rc != 0) perror("Failed to write file data");
+            free(c->buf);
+            c->buf = NULL;
+            in_flight -= c->count * BS;
+        }
+    }
+    pool_stop(&pool);
+    if (rc == 0 && pop.csum && seq_put(&w, ext->csum_start, (const uint8_t *)pop.csum, csum_blocks) != 0) {
+        perror("Failed to write data checksums");
+        rc = -1;
+    }
+    if (rc == 0 && (seq_put(&w, sb->total_blocks, NULL, 0) != 0 || seq_flush(&w) != 0)) {
+        perror("Failed to write image");
+        rc = -1;
+    }
+    *bytes_written = w.bytes_written;
+    free(w.buf);
+    pop_free(&pop);
+    return rc;
+}
+
+
+int main(int argc, char *argv[]) {
+    char *imageName = NULL;
+    uint64_t size_kib = 0;
+    uint64_t inodes = 0;
+    int dense = 0;
+    int data_csum = 0;
+    int crc32c_meta = 0;
+    char *populate_dir = NULL;
+    int threads = pool_default_threads();
+    uint64_t groups = 1;
+   
+    static struct option long_options[] = {
+        {"image", required_argument, 0, 'i'},
+        {"size-kib", required_argument, 0, 's'},
+        {"inodes", required_argument, 0, 'n'},
+        {"dense", no_argument, 0, 'd'},
+        {"data-csum", no_argument, 0, 'c'},
+        {"checksum", required_argument, 0, 'k'},
+        {"populate", required_argument, 0, 'p'},
+        {"threads", required_argument, 0, 't'},
+        {"groups", required_argument, 0, 'g'},
+        {0, 0, 0, 0}
+    };
+   
+    int opt;
+    while ((opt = getopt_long(argc, argv, "i:s:n:dck:p:t:g:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'i': imageName = optarg; break;
+            case 's': size_kib = atoll(optarg); break;
+            case 'n': inodes = atoll(optarg); break;
+            case 'd': dense = 1; break;
+            case 'c': data_csum = 1; break;
+            case 'k':
+                if (strcmp(optarg, "crc32") != 0 && strcmp(optarg, "crc32c") != 0) {
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                crc32c_meta = strcmp(optarg, "crc32c") == 0;
+                break;
+            case 'p': populate_dir = optarg; break;
+            case 't': threads = atoi(optarg); break;
+            case 'g': groups = strtoull(optarg, NULL, 10); break;
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+   
+    if (!imageName || size_kib < MIN_SIZE_KIB || size_kib > MAX_SIZE_KIB ||
+        inodes < MIN_INODES || inodes > MAX_INODES || (size_kib % 4 != 0) || threads < 1 ||
+        groups < 1 || groups > MAX_GROUPS) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+    if (groups > 1 && populate_dir) {
+        fprintf(stderr, "--groups cannot be combined with --populate\n");
+        exit(EXIT_FAILURE);
+    }
+   
+    /*
+     * Allocation groups: everything after the superblock is cut into groups of
+     * 'stride' blocks (the last one may be shorter), each laid out like a small
+     * image of its own: inode bitmap, data bitmap, inode table, data blocks.
+     * Without --groups there is one group and this is the classic layout.
+     * With --data-csum the checksum table takes the end of the image: one
+     * entry for every block in front of it is always enough.
+     */
+    uint64_t total_blocks = size_kib * 1024 / BS;
+    uint64_t csum_blocks = data_csum ? (total_blocks + CSUM_PER_BLOCK) / (CSUM_PER_BLOCK + 1) : 0;
+    uint64_t layout_blocks = total_blocks - csum_blocks;
+    uint64_t stride = (layout_blocks - 1 + groups - 1) / groups;
+    uint64_t last_stride = layout_blocks - 1 - (groups - 1) * stride;
+    uint64_t inodes_per_group = inodes;
+    if (groups > 1) {
+        // Whole inode-table blocks per group.
+        inodes_per_group = (inodes + groups - 1) / groups;
+        inodes_per_group = (inodes_per_group + BS / INODE_SIZE - 1) / (BS / INODE_SIZE) * (BS / INODE_SIZE);
+        if ((groups - 1) * inodes_per_group >= inodes) {
+            fprintf(stderr, "Too many groups for %" PRIu64 " inodes\n", inodes);
+            exit(EXIT_FAILURE);
+        }
+    }
+    uint64_t inode_bitmap_blocks = (inodes_per_group + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    uint64_t inode_table_blocks = (inodes_per_group * INODE_SIZE + BS - 1) / BS;
+    uint64_t inode_table_start = 1 + inode_bitmap_blocks + 1;
+    if (inode_table_start + inode_table_blocks + 1 >= 1 + last_stride) {
+        fprintf(stderr, "File system too small for layout\n");
+        exit(EXIT_FAILURE);
+    }
+
+
+    // The data bitmap must cover the group's data blocks, which shrink as the bitmap grows.
+    uint64_t data_bitmap_blocks = 1, data_region_start, blocks_per_group;
+    for (;;) {
+        data_region_start = 1 + inode_bitmap_blocks + data_bitmap_blocks + inode_table_blocks;
+        if (data_region_start >= 1 + last_stride) {
+            fprintf(stderr, "File system too small for layout\n");
+            exit(EXIT_FAILURE);
+        }
+        blocks_per_group = 1 + stride - data_region_start;
+        uint64_t needed = (blocks_per_group + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+        if (needed <= data_bitmap_blocks) break;
+        data_bitmap_blocks = needed;
+    }
+    inode_table_start = 1 + inode_bitmap_blocks + data_bitmap_blocks;
+    uint64_t data_region_blocks = (groups - 1) * blocks_per_group + (1 + last_stride - data_region_start);
+   
+    time_t now = time(NULL);
+   
+    superblock_t sb = {
+        .magic = MVSFS_MAGIC,
+        .version = 1,
+        .block_size = BS,
+        .total_blocks = total_blocks,
+        .inode_count = inodes,
+        .inode_bitmap_start = 1,
+        .inode_bitmap_blocks = inode_bitmap_blocks,
+        .data_bitmap_start = 1 + inode_bitmap_blocks,
+        .data_bitmap_blocks = data_bitmap_blocks,
+        .inode_table_start = inode_table_start,
+        .inode_table_blocks = inode_table_blocks,
+        .data_region_start = data_region_start,
+        .data_region_blocks = data_region_blocks,
+        .root_inode = 1,
+        .mtime_epoch = now,
+        .flags = MVSFS_FEAT_COUNTERS | (groups > 1 ? MVSFS_FEAT_GROUPS : 0) |
+                 (data_csum ? MVSFS_FEAT_DATACSUM : 0) | (crc32c_meta ? MVSFS_FEAT_CRC32C : 0)
+    };
+
+    // The checksum covers the whole block, so finalize it in place in the block buffer.
+    // Only the root inode and its directory block are in use.
+    uint8_t superblock_buffer[BS] = {0};
+    memcpy(superblock_buffer, &sb, sizeof(sb));
+    *superblock_ext(superblock_buffer) = (superblock_ext_t){
+        .free_inodes = inodes - 1, .free_blocks = data_region_blocks - 1, .inode_hint = 1, .block_hint = 1,
+    };
+    if (groups > 1) {
+        superblock_ext_t *ext = superblock_ext(superblock_buffer);
+        ext->group_count = groups;
+        ext->group_stride = stride;
+        ext->inodes_per_group = inodes_per_group;
+        ext->blocks_per_group = blocks_per_group;
+    }
+    if (data_csum) {
+        superblock_ext(superblock_buffer)->csum_start = layout_blocks;
+        superblock_ext(superblock_buffer)->csum_blocks = csum_blocks;
+    }
+    superblock_crc_finalize((superblock_t *)superblock_buffer);
+
+
+    uint8_t inode_bitmap[BS] = {0};
+    inode_bitmap[0] = 0x01;
+
+
+    uint8_t data_bitmap[BS] = {0};
+    data_bitmap[0] = 0x01;
+
+
+    // Only the first block of each bitmap, the first inode-table block (root inode)
+    // and the root directory block hold data, all of them in group 0; everything else is zero.
+    uint8_t root_inode_block[BS] = {0};
+    inode_t *root_inode = (inode_t *)root_inode_block;
+    root_inode->mode = 0x4000;
+    root_inode->links = 2;    
+    root_inode->uid = 0;
+    root_inode->gid = 0;
+    root_inode->size_bytes = 2 * sizeof(dirent64_t);
+    root_inode->atime = now;
+    root_inode->mtime = now;
+    root_inode->ctime = now;
+    root_inode->direct[0] = data_region_start;
+    for (int i = 1; i < 12; i++) root_inode->direct[i] = 0;
+    root_inode->proj_id = 1234;
+    inode_crc_finalize(root_inode, sb.flags);
+
+
+    uint8_t root_dir_block[BS] = {0};
+    dirent64_t *entries = (dirent64_t *)root_dir_block;
+
+
+    entries[0].inode_no = 1;
+    entries[0].type = 2;
+    strncpy(entries[0].name, ".", sizeof(entries[0].name));
+    dirent_checksum_finalize(&entries[0]);
+
+
+    entries[1].inode_no = 1;
+    entries[1].type = 2;
+    strncpy(entries[1].name, "..", sizeof(entries[1].name));
+    dirent_checksum_finalize(&entries[1]);
+
+
+    // The root directory block is data index 0, the first entry of the checksum table.
+    uint8_t csum_block[BS] = {0};
+    ((uint32_t *)csum_block)[0] = crc32c(root_dir_block, BS);
+
+
+    int fd = open(imageName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Failed to create image file");
+        exit(EXIT_FAILURE);
+    }
+
+
+    const meta_block_t meta[] = {
+        {0, superblock_buffer, "superblock"},
+        {sb.inode_bitmap_start, inode_bitmap, "inode bitmap"},
+        {sb.data_bitmap_start, data_bitmap, "data bitmap"},
+        {sb.inode_table_start, root_inode_block, "inode table"},
+        {data_region_start, root_dir_block, "root directory"},
+        {layout_blocks, csum_block, "checksum table"},
+    };
+    size_t nmeta = sizeof(meta) / sizeof(meta[0]) - !data_csum;
+    uint64_t bytes_written = 0, bytes_zeroed = 0;
+    uint64_t files = 0, dirs = 0;
+    region_bytes_t *thread_bytes = NULL;    // --dense without --populate
+    double write_start = now_sec();
+
+
+    if (populate_dir) {
+        if (populate_image(fd, &sb, superblock_ext(superblock_buffer), now, populate_dir, threads, dense,
+                           &bytes_written, &files, &dirs) != 0) {
+            close(fd);
+            unlink(imageName);
+            exit(EXIT_FAILURE);
+        }
+    } else if (dense) {
+        thread_bytes = calloc(threads, sizeof(*thread_bytes));
+        if (!thread_bytes || region_write_image(fd, total_blocks, meta, nmeta, threads, thread_bytes) != 0) {
+            if (!thread_bytes) perror("Failed to allocate writer counters");
+            close(fd);
+            unlink(imageName);
+            exit(EXIT_FAILURE);
+        }
+        for (int t = 0; t < threads; t++) {
+            bytes_written += thread_bytes[t].written;
+            bytes_zeroed += thread_bytes[t].zeroed;
+        }
+    } else {
+        // Sparse: size the file first, then write only the blocks that are not all zero.
+        if (ftruncate(fd, (off_t)(total_blocks * BS)) != 0) {
+            perror("Failed to size image file");
+            close(fd);
+            unlink(imageName);
+            exit(EXIT_FAILURE);
+        }
+        for (size_t m = 0; m < nmeta; m++) {
+            if (write_block(fd, meta[m].buf, meta[m].block) != 0) {
+                fprintf(stderr, "Failed to write %s: %s\n", meta[m].what, strerror(errno));
+                close(fd);
+                unlink(imageName);
+                exit(EXIT_FAILURE);
+            }
+            bytes_written += BS;
+        }
+    }
+
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size != total_blocks * BS) {
+        fprintf(stderr, "File size incorrect: %lld bytes (expected: %" PRIu64 " bytes)\n",
+                (long long)st.st_size, total_blocks * BS);
+        close(fd);
+        unlink(imageName);
+        exit(EXIT_FAILURE);
+    }
+
+
+    if (close(fd) != 0) {
+        perror("Failed to close image file");
+        unlink(imageName);
+        exit(EXIT_FAILURE);
+    }
+    double write_sec = now_sec() - write_start;
+   
+    printf("File system created successfully: %s\n", imageName);
+    printf("  Size: %" PRIu64 " KiB, Inodes: %" PRIu64 ", Blocks: %" PRIu64 "\n",
+           size_kib, inodes, total_blocks);
+    if (groups > 1) {
+        printf("  Groups: %" PRIu64 " of %" PRIu64 " block(s), %" PRIu64 " inode(s) and %" PRIu64
+               " data block(s) each\n", groups, stride, inodes_per_group, blocks_per_group);
+    }
+    if (data_csum) {
+        printf("  Data checksums: %" PRIu64 " block(s) from block %" PRIu64 "\n", csum_blocks, layout_blocks);
+    }
+    if (populate_dir) {
+        printf("  Populated from %s: %" PRIu64 " file(s), %" PRIu64 " directories (%d thread(s))\n",
+               populate_dir, files, dirs, threads);
+    }
+    if (thread_bytes) {
+        printf("  Bytes written: %" PRIu64 ", zero-ranged: %" PRIu64 " (dense) in %.1f ms\n", bytes_written,
+               bytes_zeroed, write_sec * 1e3);
+        printf("  Writer threads: %d, bytes written/zero-ranged per thread:", threads);
+        for (int t = 0; t < threads; t++)
+            printf(" %" PRIu64 "/%" PRIu64, thread_bytes[t].written, thread_bytes[t].zeroed);
+        printf("\n");
+        free(thread_bytes);
+    } else {
+        printf("  Bytes written: %" PRIu64 " (%s) in %.1f ms\n", bytes_written, dense ? "dense" : "sparse",
+               write_sec * 1e3);
+    }
+   
+    return 0;
+}
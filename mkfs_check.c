@@ -0,0 +1,649 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "minivsfs.h"
+#include "compress.h"
+#include "thread_pool.h"
+
+#define BITS_PER_BLOCK ((uint64_t)BS * 8)
+#define CHECK_MAX_REPORTS 100
+#define CHECK_INODE_CHUNK 8192ull               // inodes per task, a multiple of 64
+#define CHECK_DATA_CHUNK (BITS_PER_BLOCK * 8)   // data indices per task
+
+/*
+ * Verifies a MiniVSFS image without changing it. The image is mapped
+ * read-only and its metadata is read front to back, group by group: bitmaps,
+ * then every allocated inode (checksum, mode, flags, size, block pointers).
+ * Directory and indirect blocks are the only data blocks read by the walk.
+ * What it collects is then cross-checked: every dirent checksum and target,
+ * link counts against directory references, data blocks in use against the
+ * data bitmap, and the superblock counters against both bitmaps. File data
+ * is read only on an image with data checksums, where every block in use is
+ * checked against the table while the data bitmap is. Exits nonzero if
+ * anything is wrong.
+ *
+ * The work runs in phases, each split into chunks of the inode table or of
+ * the data region that a thread pool checks independently: inodes and the
+ * directories among them, then '..' and link counts, then the data bitmap.
+ * Every task collects its own problems, and they are printed in chunk order,
+ * so the report does not depend on the thread count. Directory references
+ * are counted into per-worker tables that are summed before link counts are
+ * checked. Data blocks in use are marked in two shared bitmaps with atomic
+ * ORs (used, and used again), which gives the same result in any order.
+ */
+
+typedef struct check check_t;
+typedef struct scan scan_t;
+typedef void (*phase_fn_t)(scan_t *s, uint64_t task);
+
+// What one worker has counted; summed once all phases are done.
+typedef struct {
+    uint32_t *refs;         // directory entries naming each inode (index ino - 1)
+    uint32_t *parent;       // directories: the lowest directory holding an entry for them
+    uint64_t inodes_used, dirs, files, entries, blocks_used, bitmap_used;
+} tally_t;
+
+// What one task has found, kept until the tasks before it are printed.
+typedef struct {
+    FILE *out;
+    char *text;
+    size_t len;
+    uint64_t problems;
+    uint64_t first_free;    // lowest free inode or data index in the chunk
+} part_t;
+
+struct check {
+    const uint8_t *base;
+    superblock_t sb;
+    mvsfs_groups_t gr;
+    uint64_t span;          // data indices
+    uint64_t *seen;         // one bit per data index referenced by an inode
+    uint64_t *reused;       // ... and referenced more than once
+    uint64_t *sound;        // one bit per inode that passed check_inode
+    const uint32_t *refs;   // merged from the workers' tallies
+    const uint32_t *parent;
+    int threads;
+    tally_t *tallies;       // one per worker
+    tally_t sum;
+    uint64_t first_free_inode, first_free_block;
+    part_t *parts;          // one per task of the running phase
+    phase_fn_t phase;
+    uint64_t problems;
+};
+
+// The task being checked: where its problems and counts go.
+struct scan {
+    check_t *c;
+    part_t *p;
+    tally_t *w;
+};
+
+void usage() {
+    fprintf(stderr, "Usage: mkfs_check --image <image.img> [--threads <n>]\n");
+    fprintf(stderr, "  --threads: workers checking the image (default: one per CPU); "
+                    "the report is the same for any count\n");
+}
+
+void problem(scan_t *s, const char *fmt, ...) {
+    part_t *p = s->p;
+    if (p->problems++ >= CHECK_MAX_REPORTS) return;     // more could never be printed
+    if (!p->out && !(p->out = open_memstream(&p->text, &p->len))) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(p->out, fmt, ap);
+    va_end(ap);
+    fputc('\n', p->out);
+}
+
+static inline int bit_test(const uint8_t *bits, uint64_t i) {
+    return (bits[i / 8] >> (i % 8)) & 1;
+}
+
+static inline int word_bit_test(const uint64_t *bits, uint64_t i) {
+    return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+int inode_allocated(const check_t *c, uint64_t ino) {
+    uint64_t i = ino - 1, g = i / c->gr.inodes_per_group;
+    return bit_test(c->base + (c->sb.inode_bitmap_start + g * c->gr.stride) * BS, i % c->gr.inodes_per_group);
+}
+
+int data_allocated(const check_t *c, uint64_t idx) {
+    uint64_t g = idx / c->gr.stride;
+    return bit_test(c->base + (c->sb.data_bitmap_start + g * c->gr.stride) * BS, idx % c->gr.stride);
+}
+
+// Bits past the last object of a bitmap slice must be zero.
+void check_bitmap_tail(scan_t *s, uint64_t start, uint64_t blocks, uint64_t nbits, const char *what, uint64_t g) {
+    const uint8_t *bits = s->c->base + start * BS;
+    for (uint64_t i = nbits; i < blocks * BITS_PER_BLOCK; i++) {
+        if (i % 8 == 0 && i + 8 <= blocks * BITS_PER_BLOCK && bits[i / 8] == 0) {
+            i += 7;
+            continue;
+        }
+        if (bit_test(bits, i)) {
+            problem(s, "group %" PRIu64 ": %s bitmap has bit %" PRIu64 " set past its last object", g, what, i);
+            return;
+        }
+    }
+}
+
+// Records a data or indirect block of inode ino. Returns 0 if the block can be read.
+int use_block(scan_t *s, uint64_t ino, uint32_t block, const char *what) {
+    check_t *c = s->c;
+    if (!block_in_data_region(c->base, &c->sb, block)) {
+        problem(s, "inode %" PRIu64 ": %s %" PRIu32 " is outside the data region", ino, what, block);
+        return -1;
+    }
+    uint64_t idx = block - c->sb.data_region_start;
+    if (!data_allocated(c, idx))
+        problem(s, "inode %" PRIu64 ": %s %" PRIu32 " is free in the data bitmap", ino, what, block);
+    // Reuse is reported per block by the data pass, which sees every reference.
+    uint64_t bit = 1ull << (idx % 64);
+    if (__atomic_fetch_or(&c->seen[idx / 64], bit, __ATOMIC_RELAXED) & bit)
+        __atomic_fetch_or(&c->reused[idx / 64], bit, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Blocks an inode occupies as stored; for a compressed file that comes from its header.
+int64_t stored_blocks(scan_t *s, uint64_t ino, const inode_t *in) {
+    const check_t *c = s->c;
+    uint64_t nblocks = (in->size_bytes + BS - 1) / BS;
+    if (!(in->reserved_0 & INODE_F_COMPRESSED) || nblocks == 0) return nblocks;
+    mvz_header_t hdr;
+    if (!block_in_data_region(c->base, &c->sb, in->direct[0]) ||
+        inode_read_raw(c->base, &c->sb, in, 0, (uint8_t *)&hdr, sizeof(hdr)) != 0 || hdr.magic != MVZ_MAGIC ||
+        hdr.group_size != MVZ_GROUP_SIZE || hdr.ngroups != mvz_group_count(in->size_bytes)) {
+        problem(s, "inode %" PRIu64 ": corrupt compressed file header", ino);
+        return -1;
+    }
+    uint64_t total = mvz_table_bytes(hdr.ngroups);
+    for (uint64_t g = 0; g < hdr.ngroups; g++) {
+        uint32_t len;
+        if (inode_read_raw(c->base, &c->sb, in, sizeof(hdr) + g * sizeof(len), (uint8_t *)&len, sizeof(len)) != 0 ||
+            (len & ~MVZ_STORED) > MVZ_GROUP_SIZE) {
+            problem(s, "inode %" PRIu64 ": corrupt compressed group table", ino);
+            return -1;
+        }
+        total += len & ~MVZ_STORED;
+    }
+    return (total + BS - 1) / BS;
+}
+
+// Walks the block pointers of an inode's first nblocks blocks, indirect blocks included.
+void check_inode_blocks(scan_t *s, uint64_t ino, const inode_t *in, uint64_t nblocks, int holes_ok) {
+    const check_t *c = s->c;
+    const uint8_t *base = c->base;
+    for (uint64_t k = 0; k < nblocks && k < N_DIRECT; k++) {
+        if (in->direct[k]) use_block(s, ino, in->direct[k], "block");
+        else if (!holes_ok) problem(s, "inode %" PRIu64 ": block %" PRIu64 " is not mapped", ino, k);
+    }
+    if (nblocks <= N_DIRECT) return;
+    if (!(c->sb.flags & MVSFS_FEAT_INDIRECT))
+        problem(s, "inode %" PRIu64 ": uses indirect blocks without the indirect feature flag", ino);
+    uint64_t rest = nblocks - N_DIRECT;
+    if (use_block(s, ino, in->reserved_1, "indirect block") == 0) {
+        const uint32_t *ptrs = (const uint32_t *)(base + (uint64_t)in->reserved_1 * BS);
+        for (uint64_t k = 0; k < rest && k < PTRS_PER_BLOCK; k++) {
+            if (ptrs[k]) use_block(s, ino, ptrs[k], "block");
+            else if (!holes_ok) problem(s, "inode %" PRIu64 ": block %" PRIu64 " is not mapped", ino, N_DIRECT + k);
+        }
+    }
+    if (rest <= PTRS_PER_BLOCK) return;
+    rest -= PTRS_PER_BLOCK;
+    if (use_block(s, ino, in->reserved_2, "double-indirect block") != 0) return;
+    const uint32_t *dbl = (const uint32_t *)(base + (uint64_t)in->reserved_2 * BS);
+    for (uint64_t i = 0; i * PTRS_PER_BLOCK < rest; i++) {
+        if (use_block(s, ino, dbl[i], "indirect block") != 0) continue;
+        const uint32_t *ptrs = (const uint32_t *)(base + (uint64_t)dbl[i] * BS);
+        for (uint64_t k = 0; k < PTRS_PER_BLOCK && i * PTRS_PER_BLOCK + k < rest; k++) {
+            if (ptrs[k]) use_block(s, ino, ptrs[k], "block");
+            else if (!holes_ok) problem(s, "inode %" PRIu64 ": block %" PRIu64 " is not mapped", ino,
+                                        N_DIRECT + PTRS_PER_BLOCK + i * PTRS_PER_BLOCK + k);
+        }
+    }
+}
+
+// Checks one allocated inode on its own; returns 0 if it is sound enough to walk further.
+int check_inode(scan_t *s, uint64_t ino, const inode_t *in) {
+    const check_t *c = s->c;
+    inode_t tmp = *in;
+    inode_crc_finalize(&tmp, c->sb.flags);
+    if (tmp.inode_crc != in->inode_crc) {
+        problem(s, "inode %" PRIu64 ": checksum mismatch", ino);
+        return -1;
+    }
+    int is_dir = in->mode == MODE_DIR, is_file = in->mode == MODE_FILE;
+    if (!is_dir && !is_file) {
+        problem(s, "inode %" PRIu64 ": invalid mode 0%o", ino, in->mode);
+        return -1;
+    }
+    if ((in->reserved_0 & ~(INODE_F_HASHDIR | INODE_F_COMPRESSED)) ||
+        ((in->reserved_0 & INODE_F_HASHDIR) && !is_dir) || ((in->reserved_0 & INODE_F_COMPRESSED) && !is_file)) {
+        problem(s, "inode %" PRIu64 ": invalid flags 0x%" PRIx32, ino, in->reserved_0);
+        return -1;
+    }
+    if (((in->reserved_0 & INODE_F_HASHDIR) && !(c->sb.flags & MVSFS_FEAT_HASHDIR)) ||
+        ((in->reserved_0 & INODE_F_COMPRESSED) && !(c->sb.flags & MVSFS_FEAT_COMPRESS)))
+        problem(s, "inode %" PRIu64 ": flags 0x%" PRIx32 " need a feature the superblock lacks", ino, in->reserved_0);
+
+    uint64_t nblocks;
+    if (is_dir && dir_is_hashed(in)) {
+        nblocks = in->size_bytes / BS;
+        if (in->size_bytes % BS || nblocks < 2 || (nblocks & (nblocks - 1)) || nblocks > MAX_FILE_BLOCKS) {
+            problem(s, "inode %" PRIu64 ": hashed directory size %" PRIu64 " is not a power-of-two bucket count",
+                    ino, in->size_bytes);
+            return -1;
+        }
+    } else if (is_dir) {
+        nblocks = 1;
+        if (in->size_bytes % sizeof(dirent64_t) || in->size_bytes < 2 * sizeof(dirent64_t) || in->size_bytes > BS) {
+            problem(s, "inode %" PRIu64 ": directory size %" PRIu64 " is invalid", ino, in->size_bytes);
+            return -1;
+        }
+    } else {
+        if (in->size_bytes > MAX_FILE_BLOCKS * BS) {
+            problem(s, "inode %" PRIu64 ": size %" PRIu64 " exceeds the largest file", ino, in->size_bytes);
+            return -1;
+        }
+        int64_t n = stored_blocks(s, ino, in);
+        if (n < 0) return -1;
+        nblocks = n;
+    }
+    check_inode_blocks(s, ino, in, nblocks, is_file);
+    return 0;
+}
+
+void check_dirent_target(scan_t *s, uint64_t dir, const dirent64_t *de) {
+    const check_t *c = s->c;
+    uint64_t t = de->inode_no;
+    if (t < ROOT_INO || t > c->sb.inode_count || !inode_allocated(c, t)) {
+        problem(s, "directory %" PRIu64 ": entry '%.57s' names free or invalid inode %" PRIu64, dir, de->name, t);
+        return;
+    }
+    const inode_t *in = inode_ptr(c->base, &c->sb, t);
+    if ((de->type == DIRENT_DIR) != (in->mode == MODE_DIR) || (de->type != DIRENT_DIR && de->type != DIRENT_FILE))
+        problem(s, "directory %" PRIu64 ": entry '%.57s' has type %u but inode %" PRIu64 " has mode 0%o",
+                dir, de->name, de->type, t, in->mode);
+}
+
+// Checks every entry of directory ino and counts the references it makes.
+void check_dir(scan_t *s, uint64_t ino, const inode_t *dir) {
+    const check_t *c = s->c;
+    tally_t *w = s->w;
+    uint64_t slots = dir_slot_count(dir), children = 0, bad = 0;
+    for (uint64_t i = 0; i < slots; i++) {
+        const dirent64_t *de = dir_slot(c->base, &c->sb, dir, i);
+        if (!de) return;    // already reported by the block walk
+        if (i % DIRENTS_PER_BLOCK == 0)
+            bad = dirent_block_bad(de, slots - i < DIRENTS_PER_BLOCK ? slots - i : DIRENTS_PER_BLOCK);
+        if (de->inode_no == 0 && i >= 2) continue;
+        if ((bad >> (i % DIRENTS_PER_BLOCK)) & 1) {
+            problem(s, "directory %" PRIu64 ": entry %" PRIu64 " checksum mismatch", ino, i);
+            continue;
+        }
+        if (i < 2) {
+            const char *want = i == 0 ? "." : "..";
+            if (strncmp(de->name, want, 58) != 0 || de->type != DIRENT_DIR)
+                problem(s, "directory %" PRIu64 ": slot %" PRIu64 " is not '%s'", ino, i, want);
+            else if (i == 0 && de->inode_no != ino)
+                problem(s, "directory %" PRIu64 ": '.' names inode %" PRIu32, ino, de->inode_no);
+            continue;
+        }
+        w->entries++;
+        children++;
+        if (de->name[0] == '\0' || memchr(de->name, '\0', 58) == NULL || strchr(de->name, '/') ||
+            strcmp(de->name, ".") == 0 || strcmp(de->name, "..") == 0) {
+            problem(s, "directory %" PRIu64 ": entry %" PRIu64 " has an invalid name", ino, i);
+            continue;
+        }
+        // Finds duplicates, and entries a hashed lookup would not reach.
+        if (dir_lookup(c->base, &c->sb, dir, de->name) != de)
+            problem(s, "directory %" PRIu64 ": entry '%s' is a duplicate or unreachable by lookup", ino, de->name);
+        check_dirent_target(s, ino, de);
+        uint64_t t = de->inode_no;
+        if (t >= ROOT_INO && t <= c->sb.inode_count) {
+            w->refs[t - 1]++;
+            if (de->type == DIRENT_DIR && t != ROOT_INO && (!w->parent[t - 1] || ino < w->parent[t - 1]))
+                w->parent[t - 1] = ino;
+        }
+    }
+    if (dir->links != 2 + children)
+        problem(s, "directory %" PRIu64 ": link count %u, expected %" PRIu64, ino, dir->links, 2 + children);
+}
+
+// '..' can only be checked once every directory's parent is known.
+void check_dotdot(scan_t *s, uint64_t ino, const inode_t *dir) {
+    const check_t *c = s->c;
+    const dirent64_t *de = dir_slot(c->base, &c->sb, dir, 1);
+    uint64_t want = ino == ROOT_INO ? ROOT_INO : c->parent[ino - 1];
+    if (de && want && strncmp(de->name, "..", 58) == 0 && de->inode_no != want)
+        problem(s, "directory %" PRIu64 ": '..' names inode %" PRIu32 ", expected %" PRIu64, ino, de->inode_no, want);
+}
+
+static void phase_task(void *arg, size_t task, int worker) {
+    check_t *c = arg;
+    scan_t s = { c, &c->parts[task], &c->tallies[worker] };
+    c->phase(&s, task);
+}
+
+// Prints what task t found, stopping where the report stops, and returns its first_free.
+uint64_t flush_part(check_t *c, uint64_t t) {
+    part_t *p = &c->parts[t];
+    if (p->out) fclose(p->out);
+    for (char *line = p->text; line && line < p->text + p->len; ) {
+        char *end = memchr(line, '\n', p->text + p->len - line);
+        if (c->problems < CHECK_MAX_REPORTS) fwrite(line, 1, end - line + 1, stdout);
+        c->problems++;
+        p->problems--;
+        line = end + 1;
+    }
+    c->problems += p->problems;     // the ones past the task's own limit
+    free(p->text);
+    return p->first_free;
+}
+
+// Runs fn on tasks [0, ntasks), printing what they found in task order as they
+// finish. Returns the lowest first_free any task recorded.
+uint64_t run_phase(check_t *c, uint64_t ntasks, phase_fn_t fn) {
+    c->parts = calloc(ntasks, sizeof(*c->parts));
+    if (!c->parts) {
+        perror("Failed to allocate check tables");
+        exit(EXIT_FAILURE);
+    }
+    for (uint64_t t = 0; t < ntasks; t++) c->parts[t].first_free = UINT64_MAX;
+    uint64_t first_free = UINT64_MAX;
+    if (c->threads == 1 || ntasks == 1) {
+        for (uint64_t t = 0; t < ntasks; t++) {
+            scan_t s = { c, &c->parts[t], &c->tallies[0] };
+            fn(&s, t);
+            uint64_t f = flush_part(c, t);
+            if (f < first_free) first_free = f;
+        }
+    } else {
+        pool_t pool;
+        c->phase = fn;
+        if (pool_start(&pool, c->threads, ntasks, phase_task, c) != 0) {
+            fprintf(stderr, "Failed to start checker threads\n");
+            exit(EXIT_FAILURE);
+        }
+        for (uint64_t t = 0; t < ntasks; t++) {
+            if (pool_submit(&pool, t) != 0) {
+                fprintf(stderr, "Failed to queue checker tasks\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (uint64_t t = 0; t < ntasks; t++) {
+            pool_wait_task(&pool, t);
+            uint64_t f = flush_part(c, t);
+            if (f < first_free) first_free = f;
+        }
+        pool_stop(&pool);
+    }
+    free(c->parts);
+    c->parts = NULL;
+    return first_free;
+}
+
+void root_phase(scan_t *s, uint64_t task) {
+    (void)task;
+    problem(s, "root inode is not an allocated directory");
+}
+
+void bitmap_tails_phase(scan_t *s, uint64_t task) {
+    (void)task;
+    const check_t *c = s->c;
+    for (uint64_t g = 0; g < c->gr.count; g++) {
+        check_bitmap_tail(s, c->sb.inode_bitmap_start + g * c->gr.stride, c->sb.inode_bitmap_blocks,
+                          group_inodes(&c->sb, &c->gr, g), "inode", g);
+        check_bitmap_tail(s, c->sb.data_bitmap_start + g * c->gr.stride, c->sb.data_bitmap_blocks,
+                          group_data_blocks(&c->sb, &c->gr, g), "data", g);
+    }
+}
+
+// Every allocated inode of the chunk, and the entries of the directories among them.
+void inodes_phase(scan_t *s, uint64_t task) {
+    check_t *c = s->c;
+    uint64_t first = task * CHECK_INODE_CHUNK + 1, last = first + CHECK_INODE_CHUNK - 1;
+    if (last > c->sb.inode_count) last = c->sb.inode_count;
+    for (uint64_t ino = first; ino <= last; ino++) {
+        if (!inode_allocated(c, ino)) continue;
+        s->w->inodes_used++;
+        const inode_t *in = inode_ptr(c->base, &c->sb, ino);
+        if (check_inode(s, ino, in) != 0) continue;
+        c->sound[(ino - 1) / 64] |= 1ull << ((ino - 1) % 64);     // chunks own whole words
+        if (in->mode == MODE_DIR) {
+            s->w->dirs++;
+            check_dir(s, ino, in);
+        } else {
+            s->w->files++;
+        }
+    }
+}
+
+// Sums the per-worker reference tables into worker 0's.
+void merge_phase(scan_t *s, uint64_t task) {
+    check_t *c = s->c;
+    uint64_t first = task * CHECK_INODE_CHUNK, end = first + CHECK_INODE_CHUNK;
+    if (end > c->sb.inode_count) end = c->sb.inode_count;
+    tally_t *into = &c->tallies[0];
+    for (int t = 1; t < c->threads; t++) {
+        const tally_t *w = &c->tallies[t];
+        for (uint64_t i = first; i < end; i++) {
+            into->refs[i] += w->refs[i];
+            if (w->parent[i] && (!into->parent[i] || w->parent[i] < into->parent[i])) into->parent[i] = w->parent[i];
+        }
+    }
+}
+
+// '..' and link counts, which need every directory's references.
+void links_phase(scan_t *s, uint64_t task) {
+    const check_t *c = s->c;
+    uint64_t first = task * CHECK_INODE_CHUNK + 1, last = first + CHECK_INODE_CHUNK - 1;
+    if (last > c->sb.inode_count) last = c->sb.inode_count;
+    for (uint64_t ino = first; ino <= last; ino++) {
+        if (!inode_allocated(c, ino)) {
+            if (s->p->first_free == UINT64_MAX) s->p->first_free = ino - 1;
+            continue;
+        }
+        const inode_t *in = inode_ptr(c->base, &c->sb, ino);
+        if (word_bit_test(c->sound, ino - 1) && in->mode == MODE_DIR) check_dotdot(s, ino, in);
+        if (ino == ROOT_INO) continue;
+        if (c->refs[ino - 1] == 0)
+            problem(s, "inode %" PRIu64 ": allocated but not in any directory", ino);
+        else if (in->mode == MODE_DIR ? c->refs[ino - 1] != 1 : c->refs[ino - 1] != in->links)
+            problem(s, "inode %" PRIu64 ": link count %u, but %" PRIu32 " directory entries", ino, in->links,
+                    c->refs[ino - 1]);
+    }
+}
+
+// The data bitmap against the blocks the inodes use, and those blocks against their checksums.
+void data_phase(scan_t *s, uint64_t task) {
+    const check_t *c = s->c;
+    int csum = (c->sb.flags & MVSFS_FEAT_DATACSUM) != 0;
+    uint64_t first = task * CHECK_DATA_CHUNK, end = first + CHECK_DATA_CHUNK;
+    if (end > c->span) end = c->span;
+    for (uint64_t idx = first; idx < end; idx++) {
+        if (idx % c->gr.stride >= group_data_blocks(&c->sb, &c->gr, idx / c->gr.stride)) continue;
+        int used = data_allocated(c, idx), seen = word_bit_test(c->seen, idx);
+        if (used) s->w->bitmap_used++;
+        else if (s->p->first_free == UINT64_MAX) s->p->first_free = idx;
+        if (seen) s->w->blocks_used++;
+        if (word_bit_test(c->reused, idx) && !(c->sb.flags & MVSFS_FEAT_SHARED))
+            problem(s, "block %" PRIu64 ": used more than once", c->sb.data_region_start + idx);
+        if (used && !seen)
+            problem(s, "block %" PRIu64 ": used in the data bitmap but not by any inode",
+                    c->sb.data_region_start + idx);
+        if (csum && used && seen &&
+            crc32c(c->base + (c->sb.data_region_start + idx) * BS, BS) != *data_csum_entry(c->base, idx))
+            problem(s, "block %" PRIu64 ": data checksum mismatch", c->sb.data_region_start + idx);
+    }
+}
+
+void counters_phase(scan_t *s, uint64_t task) {
+    (void)task;
+    const check_t *c = s->c;
+    const tally_t *sum = &c->sum;
+    uint64_t free_inodes = c->sb.inode_count - sum->inodes_used;
+    const superblock_ext_t *ext = superblock_ext((void *)c->base);
+    if (ext->free_inodes != free_inodes)
+        problem(s, "superblock: %" PRIu64 " free inodes recorded, %" PRIu64 " in the bitmap",
+                ext->free_inodes, free_inodes);
+    if (ext->free_blocks != c->sb.data_region_blocks - sum->bitmap_used)
+        problem(s, "superblock: %" PRIu64 " free data blocks recorded, %" PRIu64 " in the bitmap",
+                ext->free_blocks, c->sb.data_region_blocks - sum->bitmap_used);
+    if (ext->inode_hint > c->first_free_inode || ext->block_hint > c->first_free_block)
+        problem(s, "superblock: allocation hints point past free inodes or blocks");
+}
+
+void sum_tallies(check_t *c) {
+    c->sum = (tally_t){0};
+    for (int t = 0; t < c->threads; t++) {
+        const tally_t *w = &c->tallies[t];
+        c->sum.inodes_used += w->inodes_used;
+        c->sum.dirs += w->dirs;
+        c->sum.files += w->files;
+        c->sum.entries += w->entries;
+        c->sum.blocks_used += w->blocks_used;
+        c->sum.bitmap_used += w->bitmap_used;
+    }
+}
+
+// Everything after the superblock itself. Returns the number of problems found.
+uint64_t check_image(check_t *c) {
+    const superblock_t *sb = &c->sb;
+    uint64_t inode_tasks = (sb->inode_count + CHECK_INODE_CHUNK - 1) / CHECK_INODE_CHUNK;
+    uint64_t data_tasks = (c->span + CHECK_DATA_CHUNK - 1) / CHECK_DATA_CHUNK;
+    if ((uint64_t)c->threads > inode_tasks) c->threads = inode_tasks;
+    c->seen = calloc((c->span + 63) / 64, sizeof(*c->seen));
+    c->reused = calloc((c->span + 63) / 64, sizeof(*c->reused));
+    c->sound = calloc((sb->inode_count + 63) / 64, sizeof(*c->sound));
+    c->tallies = calloc(c->threads, sizeof(*c->tallies));
+    if (!c->seen || !c->reused || !c->sound || !c->tallies) {
+        perror("Failed to allocate check tables");
+        exit(EXIT_FAILURE);
+    }
+    for (int t = 0; t < c->threads; t++) {
+        c->tallies[t].refs = calloc(sb->inode_count, sizeof(*c->tallies[t].refs));
+        c->tallies[t].parent = calloc(sb->inode_count, sizeof(*c->tallies[t].parent));
+        if (!c->tallies[t].refs || !c->tallies[t].parent) {
+            perror("Failed to allocate check tables");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    run_phase(c, 1, bitmap_tails_phase);
+    run_phase(c, inode_tasks, inodes_phase);
+    sum_tallies(c);
+    if (!word_bit_test(c->sound, ROOT_INO - 1) || inode_ptr(c->base, sb, ROOT_INO)->mode != MODE_DIR) {
+        run_phase(c, 1, root_phase);
+        return c->problems;
+    }
+    if (c->threads > 1) run_phase(c, inode_tasks, merge_phase);
+    c->refs = c->tallies[0].refs;
+    c->parent = c->tallies[0].parent;
+    c->first_free_inode = run_phase(c, inode_tasks, links_phase);
+    c->first_free_block = run_phase(c, data_tasks, data_phase);
+    sum_tallies(c);
+    if (c->first_free_inode > sb->inode_count) c->first_free_inode = sb->inode_count;
+    if (c->first_free_block > c->span) c->first_free_block = c->span;
+    if (sb->flags & MVSFS_FEAT_COUNTERS) run_phase(c, 1, counters_phase);
+    return c->problems;
+}
+
+int main(int argc, char *argv[]) {
+    char *image_name = NULL;
+    int threads = pool_default_threads();
+
+    static struct option long_options[] = {
+        {"image", required_argument, 0, 'i'},
+        {"threads", required_argument, 0, 't'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "i:t:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'i': image_name = optarg; break;
+            case 't': threads = atoi(optarg); break;
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (!image_name || optind != argc || threads < 1) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = open(image_name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Failed to open image");
+        exit(EXIT_FAILURE);
+    }
+    uint8_t block0[BS];
+    if (pread(fd, block0, BS, 0) != BS || ((const superblock_t *)block0)->magic != MVSFS_MAGIC) {
+        printf("%s: invalid file system magic number\n", image_name);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    check_t c = { .threads = threads };
+    memcpy(&c.sb, block0, sizeof(c.sb));
+    ((superblock_t *)block0)->checksum = 0;
+    if (mvsfs_crc(c.sb.flags, block0, BS - 4) != c.sb.checksum) {
+        printf("%s: superblock checksum mismatch\n", image_name);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    if (c.sb.flags & ~MVSFS_FEAT_KNOWN) {
+        printf("%s: unsupported features (flags 0x%x)\n", image_name, c.sb.flags);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    const char *layout_error = superblock_layout_error(&c.sb, block0, st.st_size);
+    if (layout_error) {
+        printf("%s: superblock layout is inconsistent with the image size (%s)\n", image_name, layout_error);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t size = c.sb.total_blocks * BS;
+    c.base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (c.base == MAP_FAILED) {
+        perror("Failed to map image");
+        exit(EXIT_FAILURE);
+    }
+    madvise((void *)c.base, size, MADV_SEQUENTIAL);
+    c.gr = mvsfs_groups(&c.sb, c.base);
+    c.span = data_index_span(&c.sb, &c.gr);
+
+    check_image(&c);
+    if (c.problems > CHECK_MAX_REPORTS) printf("... and %" PRIu64 " more\n", c.problems - CHECK_MAX_REPORTS);
+    printf("%s: %s, %" PRIu64 "/%" PRIu64 " inodes (%" PRIu64 " directories, %" PRIu64 " files), %" PRIu64
+           "/%" PRIu64 " data blocks, %" PRIu64 " problem(s)\n",
+           image_name, c.problems ? "CORRUPT" : "clean", c.sum.inodes_used, c.sb.inode_count, c.sum.dirs,
+           c.sum.files, c.sum.blocks_used, c.sb.data_region_blocks, c.problems);
+    munmap((void *)c.base, size);
+    free(c.seen);
+    free(c.reused);
+    free(c.sound);
+    for (int t = 0; t < c.threads; t++) {
+        free(c.tallies[t].refs);
+        free(c.tallies[t].parent);
+    }
+    free(c.tallies);
+    return c.problems ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,274 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "minivsfs.h"
+#include "bitmap_alloc.h"
+#include "compress.h"
+
+/*
+ * Reads one file back out of a MiniVSFS image: follows the target path from
+ * the root directory (linear or hashed) and writes the file's content,
+ * decompressing INODE_F_COMPRESSED files group by group. With --df it
+ * reports free space instead, from the superblock counters when the image
+ * has them. On an image with data checksums every block read is checked
+ * against its table entry first, and a mismatch fails the extraction. The
+ * image is only ever mapped read-only.
+ */
+
+void usage() {
+    fprintf(stderr, "Usage: mkfs_extract --image <image.img> {--path </dir/file> [--output <file>] | --df}\n");
+    fprintf(stderr, "  --path: file to read, e.g. /usr/bin/app\n");
+    fprintf(stderr, "  --output: host file to write (default: standard output)\n");
+    fprintf(stderr, "  --df: print used and free inodes and data blocks\n");
+}
+
+int write_all(int fd, const uint8_t *buf, uint64_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("Failed to write output");
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+const inode_t *inode_get(const uint8_t *base, const superblock_t *sb, uint32_t ino) {
+    if (ino < ROOT_INO || ino > sb->inode_count) return NULL;
+    return inode_ptr(base, sb, ino);
+}
+
+// Looks up path from the root; returns the file's inode or NULL after reporting why.
+const inode_t *resolve_path(const uint8_t *base, const superblock_t *sb, const char *path) {
+    const inode_t *cur = inode_get(base, sb, ROOT_INO);
+    const char *p = path;
+    for (;;) {
+        while (*p == '/') p++;
+        if (*p == '\0') break;
+        size_t len = strcspn(p, "/");
+        if (len > 57) {
+            // No entry can have a longer name; cutting it would find a different file.
+            fprintf(stderr, "Name too long (max 57 bytes): %s\n", path);
+            return NULL;
+        }
+        char name[58] = {0};
+        memcpy(name, p, len);
+        if (!(cur->mode & MODE_DIR)) {
+            fprintf(stderr, "Not a directory on path '%s'\n", path);
+            return NULL;
+        }
+        const dirent64_t *de = dir_lookup(base, sb, cur, name);
+        if (!de || !(cur = inode_get(base, sb, de->inode_no))) {
+            fprintf(stderr, "No such file: %s\n", path);
+            return NULL;
+        }
+        p += len;
+    }
+    if (!(cur->mode & MODE_FILE)) {
+        fprintf(stderr, "Not a regular file: %s\n", path);
+        return NULL;
+    }
+    return cur;
+}
+
+// 0 if data block b matches its checksum (or the image keeps none); reports the mismatch otherwise.
+int verify_block(const uint8_t *base, const superblock_t *sb, uint32_t b) {
+    if (!(sb->flags & MVSFS_FEAT_DATACSUM)) return 0;
+    if (crc32c(base + (uint64_t)b * BS, BS) == *data_csum_entry(base, b - sb->data_region_start)) return 0;
+    fprintf(stderr, "Data checksum mismatch in block %" PRIu32 "\n", b);
+    return -1;
+}
+
+// Every block mapped by a file, for readers that do not go block by block (a compressed file maps fewer).
+int verify_file_blocks(const uint8_t *base, const superblock_t *sb, const inode_t *ino) {
+    if (!(sb->flags & MVSFS_FEAT_DATACSUM)) return 0;
+    uint64_t nblocks = (ino->size_bytes + BS - 1) / BS;
+    for (uint64_t k = 0; k < nblocks; k++) {
+        uint32_t b = inode_bmap(base, sb, ino, k);
+        if (b && verify_block(base, sb, b) != 0) return -1;
+    }
+    return 0;
+}
+
+int extract_plain(const uint8_t *base, const superblock_t *sb, const inode_t *ino, int out_fd) {
+    static const uint8_t zeros[BS];
+    uint64_t nblocks = (ino->size_bytes + BS - 1) / BS;
+    for (uint64_t k = 0; k < nblocks; k++) {
+        uint32_t b = inode_bmap(base, sb, ino, k);
+        uint64_t len = ino->size_bytes - k * BS < BS ? ino->size_bytes - k * BS : BS;
+        if (b && verify_block(base, sb, b) != 0) return -1;
+        if (write_all(out_fd, b ? base + (uint64_t)b * BS : zeros, len) != 0) return -1;
+    }
+    return 0;
+}
+
+int extract_compressed(const uint8_t *base, const superblock_t *sb, const inode_t *ino, int out_fd) {
+    uint64_t size = ino->size_bytes;
+    if (verify_file_blocks(base, sb, ino) != 0) return -1;
+    mvz_header_t hdr;
+    if (inode_read_raw(base, sb, ino, 0, (uint8_t *)&hdr, sizeof(hdr)) != 0 || hdr.magic != MVZ_MAGIC ||
+        hdr.group_size != MVZ_GROUP_SIZE || hdr.ngroups != mvz_group_count(size)) {
+        fprintf(stderr, "Corrupt compressed file header\n");
+        return -1;
+    }
+    uint32_t *lengths = malloc((hdr.ngroups ? hdr.ngroups : 1) * sizeof(*lengths));
+    uint8_t *in = malloc(MVZ_GROUP_SIZE), *out = malloc(MVZ_GROUP_SIZE);
+    int rc = 0;
+    if (!lengths || !in || !out) {
+        perror("Failed to allocate decompression buffers");
+        rc = -1;
+    } else if (inode_read_raw(base, sb, ino, sizeof(hdr), (uint8_t *)lengths,
+                              (uint64_t)hdr.ngroups * sizeof(*lengths)) != 0) {
+        fprintf(stderr, "Corrupt compressed file header\n");
+        rc = -1;
+    }
+
+    uint64_t off = mvz_table_bytes(hdr.ngroups);
+    for (uint64_t g = 0; g < hdr.ngroups && rc == 0; g++) {
+        uint64_t want = size - g * MVZ_GROUP_SIZE < MVZ_GROUP_SIZE ? size - g * MVZ_GROUP_SIZE : MVZ_GROUP_SIZE;
+        uint64_t clen = lengths[g] & ~MVZ_STORED;
+        const uint8_t *data = out;
+        if (clen > MVZ_GROUP_SIZE || inode_read_raw(base, sb, ino, off, in, clen) != 0) {
+            rc = -1;
+        } else if (lengths[g] & MVZ_STORED) {
+            data = in;
+            if (clen != want) rc = -1;
+        } else if (lz_decompress(in, clen, out, MVZ_GROUP_SIZE) != (int64_t)want) {
+            rc = -1;
+        }
+        if (rc != 0) {
+            fprintf(stderr, "Corrupt compressed data in group %" PRIu64 "\n", g);
+            break;
+        }
+        rc = write_all(out_fd, data, want);
+        off += clen;
+    }
+    free(lengths);
+    free(in);
+    free(out);
+    return rc;
+}
+
+void print_df(const uint8_t *base, const superblock_t *sb) {
+    superblock_ext_t ext = *superblock_ext((void *)base);
+    if (!(sb->flags & MVSFS_FEAT_COUNTERS) || !superblock_ext_valid(sb, &ext)) {
+        // No counters to trust: count the bitmaps, group by group.
+        mvsfs_groups_t gr = mvsfs_groups(sb, base);
+        ext.free_inodes = sb->inode_count;
+        ext.free_blocks = sb->data_region_blocks;
+        for (uint64_t g = 0; g < gr.count; g++) {
+            bitmap_t inodes, blocks;
+            bitmap_init(&inodes, (uint8_t *)base + (sb->inode_bitmap_start + g * gr.stride) * BS,
+                        group_inodes(sb, &gr, g));
+            bitmap_init(&blocks, (uint8_t *)base + (sb->data_bitmap_start + g * gr.stride) * BS,
+                        group_data_blocks(sb, &gr, g));
+            ext.free_inodes -= bitmap_count_used(&inodes);
+            ext.free_blocks -= bitmap_count_used(&blocks);
+        }
+    }
+    printf("%-12s %12s %12s %12s\n", "", "total", "used", "free");
+    printf("%-12s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n", "inodes",
+           sb->inode_count, sb->inode_count - ext.free_inodes, ext.free_inodes);
+    printf("%-12s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n", "data blocks",
+           sb->data_region_blocks, sb->data_region_blocks - ext.free_blocks, ext.free_blocks);
+}
+
+int main(int argc, char *argv[]) {
+    char *image_name = NULL;
+    char *path = NULL;
+    char *output_name = NULL;
+    int df = 0;
+
+    static struct option long_options[] = {
+        {"image", required_argument, 0, 'i'},
+        {"path", required_argument, 0, 'p'},
+        {"output", required_argument, 0, 'o'},
+        {"df", no_argument, 0, 'd'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "i:p:o:d", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'i': image_name = optarg; break;
+            case 'p': path = optarg; break;
+            case 'o': output_name = optarg; break;
+            case 'd': df = 1; break;
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (!image_name || !path == !df) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = open(image_name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Failed to open image");
+        exit(EXIT_FAILURE);
+    }
+    uint8_t block0[BS];
+    if (pread(fd, block0, BS, 0) != BS || ((const superblock_t *)block0)->magic != MVSFS_MAGIC) {
+        fprintf(stderr, "Invalid file system magic number\n");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    superblock_t sb;
+    memcpy(&sb, block0, sizeof(sb));
+    if (sb.flags & ~MVSFS_FEAT_KNOWN) {
+        fprintf(stderr, "Image uses unsupported features (flags 0x%x)\n", sb.flags);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    const char *layout_error = superblock_layout_error(&sb, block0, st.st_size);
+    if (layout_error) {
+        fprintf(stderr, "Image layout in superblock is inconsistent with the image size (%s)\n", layout_error);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    uint64_t size = sb.total_blocks * BS;
+    const uint8_t *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("Failed to map image");
+        exit(EXIT_FAILURE);
+    }
+
+    if (df) {
+        print_df(base, &sb);
+        munmap((void *)base, size);
+        return 0;
+    }
+
+    int rc = -1;
+    const inode_t *ino = resolve_path(base, &sb, path);
+    if (ino) {
+        int out_fd = output_name ? open(output_name, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+        if (out_fd < 0) {
+            perror("Failed to create output file");
+        } else {
+            rc = ino->reserved_0 & INODE_F_COMPRESSED ? extract_compressed(base, &sb, ino, out_fd)
+                                                      : extract_plain(base, &sb, ino, out_fd);
+            if (output_name && close(out_fd) != 0) rc = -1;
+            if (rc != 0 && output_name) unlink(output_name);
+        }
+    }
+    munmap((void *)base, size);
+    return rc == 0 ? 0 : EXIT_FAILURE;
+}
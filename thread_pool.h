@@ -0,0 +1,219 @@
+#ifndef MINIVSFS_THREAD_POOL_H
+#define MINIVSFS_THREAD_POOL_H
+
+/*
+ * Work-stealing thread pool for the MiniVSFS tools (link with -pthread).
+ *
+ * Tasks are plain indices [0, ntasks) handed to one callback. Each worker has
+ * its own deque: submitted tasks are spread over the deques round-robin, a
+ * worker takes the oldest task of its own deque first, and an idle worker
+ * steals the newest task of another deque. Owners therefore work through
+ * tasks roughly in submission order, which is what a caller consuming the
+ * results in order wants, while stealing keeps every core busy when task
+ * sizes are uneven. Completion is tracked per task, so a caller can wait for
+ * task t alone (pool_wait_task) or for everything submitted (pool_wait_all).
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef void (*pool_fn_t)(void *arg, size_t task, int worker);
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t *tasks;
+    size_t head, tail;  // live tasks are tasks[head..tail)
+    size_t cap;
+} pool_deque_t;
+
+typedef struct pool pool_t;
+
+typedef struct {
+    pool_t *pool;
+    int id;
+    pthread_t thread;
+} pool_worker_t;
+
+struct pool {
+    pool_fn_t fn;
+    void *arg;
+    int nthreads;
+    pool_worker_t *workers;
+    pool_deque_t *deques;
+    int next_deque;         // round-robin submission target
+    pthread_mutex_t lock;   // guards everything below
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    size_t queued;          // submitted but not yet taken
+    size_t submitted, completed;
+    uint8_t *done;          // one byte per task
+    int stop;
+};
+
+// Number of online CPUs, at least 1.
+static inline int pool_default_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+static int pool_deque_push(pool_deque_t *d, size_t task) {
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        if (d->head > 0) {
+            // Reuse the space in front of head before growing.
+            for (size_t i = d->head; i < d->tail; i++) d->tasks[i - d->head] = d->tasks[i];
+            d->tail -= d->head;
+            d->head = 0;
+        }
+        if (d->tail == d->cap) {
+            size_t cap = d->cap ? d->cap * 2 : 64;
+            size_t *tasks = realloc(d->tasks, cap * sizeof(*tasks));
+            if (!tasks) {
+                pthread_mutex_unlock(&d->lock);
+                return -1;
+            }
+            d->tasks = tasks;
+            d->cap = cap;
+        }
+    }
+    d->tasks[d->tail++] = task;
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+// Takes the oldest task (owner) or the newest one (thief). Returns 0 if empty.
+static int pool_deque_take(pool_deque_t *d, int steal, size_t *task) {
+    int got = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) {
+        *task = steal ? d->tasks[--d->tail] : d->tasks[d->head++];
+        got = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return got;
+}
+
+static int pool_take(pool_t *p, int me, size_t *task) {
+    if (pool_deque_take(&p->deques[me], 0, task)) return 1;
+    for (int i = 1; i < p->nthreads; i++) {
+        if (pool_deque_take(&p->deques[(me + i) % p->nthreads], 1, task)) return 1;
+    }
+    return 0;
+}
+
+static void *pool_worker(void *arg) {
+    pool_worker_t *w = arg;
+    pool_t *p = w->pool;
+    for (;;) {
+        size_t task;
+        if (!pool_take(p, w->id, &task)) {
+            pthread_mutex_lock(&p->lock);
+            while (p->queued == 0 && !p->stop) pthread_cond_wait(&p->work_cond, &p->lock);
+            int quit = p->queued == 0 && p->stop;
+            pthread_mutex_unlock(&p->lock);
+            if (quit) return NULL;
+            continue;
+        }
+        pthread_mutex_lock(&p->lock);
+        p->queued--;
+        pthread_mutex_unlock(&p->lock);
+
+        p->fn(p->arg, task, w->id);
+
+        pthread_mutex_lock(&p->lock);
+        p->done[task] = 1;
+        p->completed++;
+        pthread_cond_broadcast(&p->done_cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+static void pool_free(pool_t *p) {
+    for (int i = 0; i < p->nthreads; i++) {
+        pthread_mutex_destroy(&p->deques[i].lock);
+        free(p->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work_cond);
+    pthread_cond_destroy(&p->done_cond);
+    free(p->deques);
+    free(p->workers);
+    free(p->done);
+}
+
+// Starts nthreads workers for tasks [0, ntasks). Returns -1 if they could not be started.
+static int pool_start(pool_t *p, int nthreads, size_t ntasks, pool_fn_t fn, void *arg) {
+    *p = (pool_t){ .fn = fn, .arg = arg };
+    p->workers = calloc(nthreads, sizeof(*p->workers));
+    p->deques = calloc(nthreads, sizeof(*p->deques));
+    p->done = calloc(ntasks ? ntasks : 1, 1);
+    if (!p->workers || !p->deques || !p->done) {
+        free(p->workers);
+        free(p->deques);
+        free(p->done);
+        return -1;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work_cond, NULL);
+    pthread_cond_init(&p->done_cond, NULL);
+    for (int i = 0; i < nthreads; i++) pthread_mutex_init(&p->deques[i].lock, NULL);
+    p->nthreads = nthreads;
+    for (int i = 0; i < nthreads; i++) {
+        p->workers[i] = (pool_worker_t){ .pool = p, .id = i };
+        if (pthread_create(&p->workers[i].thread, NULL, pool_worker, &p->workers[i]) != 0) {
+            pthread_mutex_lock(&p->lock);
+            p->stop = 1;
+            pthread_cond_broadcast(&p->work_cond);
+            pthread_mutex_unlock(&p->lock);
+            for (int j = 0; j < i; j++) pthread_join(p->workers[j].thread, NULL);
+            pool_free(p);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The push happens under the pool lock: a worker can take the task as soon as
+ * it is in the deque, but its queued-- waits for the lock, so it always comes
+ * after the queued++ here.
+ */
+static int pool_submit(pool_t *p, size_t task) {
+    pthread_mutex_lock(&p->lock);
+    if (pool_deque_push(&p->deques[p->next_deque], task) != 0) {
+        pthread_mutex_unlock(&p->lock);
+        return -1;
+    }
+    p->next_deque = (p->next_deque + 1) % p->nthreads;
+    p->queued++;
+    p->submitted++;
+    pthread_cond_signal(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+static void pool_wait_task(pool_t *p, size_t task) {
+    pthread_mutex_lock(&p->lock);
+    while (!p->done[task]) pthread_cond_wait(&p->done_cond, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static inline void pool_wait_all(pool_t *p) {
+    pthread_mutex_lock(&p->lock);
+    while (p->completed < p->submitted) pthread_cond_wait(&p->done_cond, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Finishes every submitted task, then joins the workers and frees the pool.
+static void pool_stop(pool_t *p) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->nthreads; i++) pthread_join(p->workers[i].thread, NULL);
+    pool_free(p);
+}
+
+#endif